@@ -0,0 +1,163 @@
+/*
+ * Access list of badges, looked up by card UID
+ */
+
+#ifndef INC_ACCESS_H_
+#define INC_ACCESS_H_
+
+/* Includes */
+#include "main.h"
+
+/* Configuration */
+#define ACCESS_UID_MAX_LEN  10 // longest ISO14443A UID (triple size)
+#define ACCESS_MAX_PROBES   8  // slots a UID may land in, every lookup reads all of them
+#define ACCESS_QSPI_BASE    0x90000000 // QSPI flash memory mapped window
+#define ACCESS_IMAGE_OFFSET 0x00000000 // where the access list image starts in QSPI flash
+#define ACCESS_IMAGE_MAGIC  0x324C4341 // "ACL2"
+#define ACCESS_FILTER_HASHES 4 // bits set per badge in the Bloom filter
+#define ACCESS_REPORT_INTERVAL_MS 60000 // at most one filter report per interval
+#define ACCESS_BATCH_MAGIC  0x5AA5 // starts a delta batch and its reply, bytes A5 5A
+#define ACCESS_BATCH_MAX    32 // changes in one delta batch
+
+/* Delta operations */
+#define ACCESS_DELTA_ADD     0x01 // add a badge or replace the one with the same UID
+#define ACCESS_DELTA_REVOKE  0x02 // remove a badge, a badge that is not there is not an error
+#define ACCESS_DELTA_MODIFY  0x03 // replace a badge that has to be there already
+
+/* Record flags */
+#define ACCESS_FLAG_USED     0x01 // slot holds a badge
+#define ACCESS_FLAG_BLOCKED  0x02 // badge is known but refused, a lost or revoked card
+
+/* Status enumeration */
+typedef enum {
+	ACCESS_OK = 0, ACCESS_FULL, ACCESS_NOTFOUND, ACCESS_ERR,
+} Access_Status_t;
+
+/* One badge, a whole Cortex-M7 cache line so a probe never straddles two */
+typedef struct {
+	uint8_t uid_size;
+	uint8_t uid[ACCESS_UID_MAX_LEN]; // zero padded after uid_size bytes
+	uint8_t flags;
+	uint32_t groups; // doors the badge opens, one bit per door group
+	uint32_t valid_from; // first second the badge is valid, 0 for no limit
+	uint32_t valid_until; // last second the badge is valid, 0 for no limit
+	uint8_t reserved[8];
+} __attribute__((aligned(32))) Access_Record_t;
+
+/*
+ * Access list image in QSPI flash. The header is followed by the Bloom filter
+ * of the badges (filter_bits / 8 bytes) and then the slots. Lookups read the
+ * slots in place through the memory mapped window, only the filter is copied
+ * to internal RAM.
+ */
+typedef struct {
+	uint32_t magic;
+	uint32_t version; // increases with every image written
+	uint32_t capacity; // slots in the image, a power of two
+	uint32_t count; // badges stored
+	uint32_t filter_bits; // bits in the filter, a power of two of at least 256, or 0 for none
+	uint32_t crc; // CRC-32 of the filter and the slots
+	uint32_t header_crc; // CRC-32 of the fields above
+	uint32_t reserved;
+} __attribute__((aligned(32))) Access_Image_t;
+
+/* Open addressing table with a fixed probe window, the slots are supplied by the caller */
+typedef struct {
+	Access_Record_t *slots;
+	uint32_t mask; // slot count - 1, the count is a power of two
+	uint32_t count; // badges stored
+	uint32_t version; // version of the mapped image, 0 for a table in RAM
+	uint8_t readonly; // slots are in QSPI flash and cannot be changed in place
+	uint8_t verified; // the image's filter and slots matched its CRC
+	uint8_t damaged; // they did not, every badge is refused
+	const Access_Image_t *image; // mapped image, NULL for a table in RAM
+	uint32_t last_cycles; // CPU cycles of the last lookup
+	uint32_t max_cycles; // slowest lookup so far
+	uint32_t *filter; // Bloom filter of the stored UIDs in internal RAM, NULL for none
+	uint32_t filter_mask; // filter bits - 1, the count is a power of two
+	uint32_t filter_cycles; // CPU cycles of the last filter check
+	uint32_t filter_rejects; // unknown badges the filter turned away on its own
+	uint32_t filter_misses; // unknown badges the filter let through, false positives
+	uint32_t reported; // unknown badges at the last Access_ReportFilter
+	uint32_t last_report;
+} Access_Table_t;
+
+/*
+ * Delta batch, the header is followed by count changes and a CRC-32 of both.
+ * A batch applies to the list of version from_version and makes it
+ * to_version, which is also the batch's sequence number. A batch from
+ * version 0 starts a new list with only its changes. A batch without
+ * changes only asks for the current version. Little endian, no padding.
+ */
+typedef struct __attribute__((packed)) {
+	uint16_t magic; // ACCESS_BATCH_MAGIC
+	uint8_t count;
+	uint8_t reserved;
+	uint32_t from_version;
+	uint32_t to_version;
+} Access_BatchHeader_t;
+
+/* One change of a delta batch */
+typedef struct __attribute__((packed)) {
+	uint8_t op; // ACCESS_DELTA_*
+	uint8_t uid_size;
+	uint8_t uid[ACCESS_UID_MAX_LEN];
+	uint8_t flags; // ACCESS_FLAG_BLOCKED, the other flags are ignored
+	uint8_t reserved[3];
+	uint32_t groups;
+	uint32_t valid_from;
+	uint32_t valid_until;
+} Access_Delta_t;
+
+/* Reply to every delta batch */
+typedef struct __attribute__((packed)) {
+	uint16_t magic; // ACCESS_BATCH_MAGIC
+	uint8_t status; // Access_Status_t
+	uint8_t reserved;
+	uint32_t version; // version of the active list, the host resumes from here
+} Access_BatchReply_t;
+
+/*
+ * Access list with two banks. Lookups use the active bank while a new list
+ * is staged into the other, and a commit swaps them with a single store.
+ * Fill in stores, filters, capacity and filter_bits, then call Access_ListInit.
+ */
+typedef struct {
+	Access_Table_t banks[2];
+	Access_Record_t *stores[2]; // RAM slots of each bank
+	uint32_t *filters[2]; // Bloom filter of each bank in internal RAM, NULL for none
+	uint32_t capacity; // slots in each store, a power of two
+	uint32_t filter_bits; // room in each filter in bits, a power of two, filters are sized to the list up to it
+	uint32_t active; // bank lookups use
+	uint32_t readers[2]; // lookups in progress in each bank
+	Access_Image_t staged; // header of the image being staged, magic is 0 for a table built in place
+	uint32_t swaps; // commits so far
+	uint32_t swap_cycles; // CPU cycles the last swap took
+	uint32_t max_pause_cycles; // longest a lookup spent picking its bank
+	Access_BatchHeader_t last; // last batch committed, the inactive bank still lacks it
+	Access_Delta_t last_changes[ACCESS_BATCH_MAX];
+	uint8_t seeded[2]; // the store behind a bank on the image holds a copy of it
+} Access_List_t;
+
+/* Exported functions */
+extern Access_Status_t Access_Init(Access_Table_t *table, Access_Record_t *slots, uint32_t capacity);
+extern Access_Status_t Access_Insert(Access_Table_t *table, const Access_Record_t *record);
+extern Access_Status_t Access_Remove(Access_Table_t *table, const uint8_t *uid, uint8_t uid_size);
+extern const Access_Record_t* Access_Lookup(Access_Table_t *table, const uint8_t *uid, uint8_t uid_size);
+extern Access_Status_t Access_Map(Access_Table_t *table, uint32_t offset);
+extern Access_Status_t Access_Verify(Access_Table_t *table);
+extern Access_Status_t Access_SaveImage(const Access_Table_t *table, uint32_t offset, uint32_t version);
+extern Access_Status_t Access_SetFilter(Access_Table_t *table, uint32_t *filter, uint32_t bits);
+extern void Access_ReportFilter(Access_Table_t *table);
+extern Access_Status_t Access_ListInit(Access_List_t *list);
+extern Access_Table_t* Access_Stage(Access_List_t *list, uint32_t version);
+extern Access_Status_t Access_StageImage(Access_List_t *list, const Access_Image_t *image);
+extern Access_Status_t Access_StageWrite(Access_List_t *list, uint32_t offset, const void *data, uint32_t size);
+extern Access_Status_t Access_Commit(Access_List_t *list);
+extern Access_Status_t Access_ApplyBatch(Access_List_t *list, const uint8_t *batch, uint32_t size);
+extern uint8_t Access_ListGrant(Access_List_t *list, const uint8_t *uid, uint8_t uid_size, uint32_t groups,
+        uint32_t now);
+extern uint8_t Access_Grant(Access_Table_t *table, const uint8_t *uid, uint8_t uid_size, uint32_t groups,
+        uint32_t now);
+
+#endif /* INC_ACCESS_H_ */
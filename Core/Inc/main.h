@@ -40,6 +40,16 @@ extern int _write(int fd, char *ptr, int len);
 #define SPIx_CS_PIN                      GPIO_PIN_11 // D10
 #define SPIx_CS_GPIO_PORT                GPIOA
 
+/* Definition for SPIx DMA streams (RM0410 table 27) */
+#define SPIx_DMA_CLK_ENABLE()            __HAL_RCC_DMA1_CLK_ENABLE()
+#define SPIx_TX_DMA_STREAM               DMA1_Stream4
+#define SPIx_TX_DMA_CHANNEL              DMA_CHANNEL_0
+#define SPIx_TX_DMA_IRQn                 DMA1_Stream4_IRQn
+#define SPIx_RX_DMA_STREAM               DMA1_Stream3
+#define SPIx_RX_DMA_CHANNEL              DMA_CHANNEL_0
+#define SPIx_RX_DMA_IRQn                 DMA1_Stream3_IRQn
+#define SPIx_IRQn                        SPI2_IRQn
+
 void Error_Handler(void);
 
 #endif
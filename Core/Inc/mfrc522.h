@@ -10,8 +10,10 @@
 
 /* Includes */
 #include "main.h"
+#include "FreeRTOS.h"
+#include "semphr.h"
 
-/* Pin and port definitions */
+/* Pin and port definitions of the on-board reader */
 #define MFRC522_PIN_CS     GPIO_PIN_11 // D10 (PA11)
 #define MFRC522_PORT_CS    GPIOA
 #define MFRC522_PIN_MOSI   GPIO_PIN_15 // D11 (PB15)
@@ -20,17 +22,256 @@
 #define MFRC522_PORT_MISO  GPIOB
 #define MFRC522_PIN_SCLK   GPIO_PIN_12 // D13 (PA12)
 #define MFRC522_PORT_SCLK  GPIOA
+#define MFRC522_PIN_IRQ    GPIO_PIN_1  // D2 (PJ1)
+#define MFRC522_PORT_IRQ   GPIOJ
+#define MFRC522_IRQ_CLK_ENABLE() __HAL_RCC_GPIOJ_CLK_ENABLE()
+#define MFRC522_IRQ_EXTI_IRQn    EXTI1_IRQn
+
+/* Transport configuration */
+#define MFRC522_USE_DMA      1  // use the SPI DMA streams once the scheduler is running
+#define MFRC522_DMA_TIMEOUT  10 // ms to wait for a DMA transfer before aborting it
+#define MFRC522_USE_IRQ      1  // sleep on the IRQ pin instead of polling the IRQ registers
+#define MFRC522_IRQ_MARGIN   5  // ms to wait for the IRQ pin beyond the programmed timeout
+#define MFRC522_INVENTORY_RETRIES 3 // failed selections tolerated per inventory pass
+#define MFRC522_MAX_READERS  4  // readers the IRQ and DMA callbacks can dispatch to
+#define MFRC522_SPI_MAX_HZ   10000000 // fastest SPI clock the reader supports (section 8.1.2)
+#define MFRC522_CALIBRATION_ROUNDS 3 // VERSION and FIFO checks per SPI clock during calibration
+#define MFRC522_DMA_BUF_SIZE 96 // DMA bounce buffer size, longer transfers are polled
+#define MFRC522_MAX_LEN      18 // longest answer read back from the FIFO, a block and its CRC_A
+#define MFRC522_FIFO_SIZE    64 // size of the internal FIFO buffer
+#define MFRC522_WATER_LEVEL  32 // FIFO level for LoAlert/HiAlert while streaming longer frames
+
+/* Frame waiting times in microseconds, measured by the reader's timer */
+#define MFRC522_TIMEOUT_REQA     1000  // REQA/WUPA, ATQA follows within ~100 us
+#define MFRC522_TIMEOUT_SELECT   5000  // anticollision and SELECT
+#define MFRC522_TIMEOUT_HALT     1000  // HALT is acknowledged by silence
+#define MFRC522_TIMEOUT_MIFARE   10000 // MIFARE Classic authentication, read, write and value commands
+#define MFRC522_TIMEOUT_RATS     5000  // activation frame waiting time, 65536 / fc (ISO14443-4 section 5.1)
+#define MFRC522_TIMEOUT_DEFAULT  25000 // everything else, until a command sets its own
+
+/* Power modes between presence checks */
+#define MFRC522_POWER_ALWAYS_ON       0 // antenna stays on
+#define MFRC522_POWER_ANTENNA_OFF     1 // antenna is switched off
+#define MFRC522_POWER_SOFT_POWERDOWN  2 // PowerDown bit in CommandReg, oscillator stops too
+#define MFRC522_POWER_MODE            MFRC522_POWER_SOFT_POWERDOWN
+
+/* Presence check cadence in ms, MFRC522_POLL_MAX_MS is the wake latency target when idle */
+#define MFRC522_POLL_MIN_MS      10   // right after a card event
+#define MFRC522_POLL_MAX_MS      200  // idle interval backs off exponentially up to this
+#define MFRC522_POLL_HOLD_MS     2000 // time after a card event before backing off
+#define MFRC522_FIELD_SETTLE_MS  5    // cards may take this long to answer once the field is on
+
+/* ISO14443A bit rates, the values of TxSpeed/RxSpeed and of DSI/DRI */
+#define MFRC522_SPEED_106  0
+#define MFRC522_SPEED_212  1
+#define MFRC522_SPEED_424  2
+#define MFRC522_SPEED_848  3
+
+/* ISO14443-4 (T=CL) configuration */
+#define MFRC522_TCL_FSDI       8 // 256 byte frames, streamed through the FIFO
+#define MFRC522_TCL_FSD        256 // frame size of MFRC522_TCL_FSDI (ISO14443-4 table 1)
+#define MFRC522_TCL_MAX_SPEED  MFRC522_SPEED_848 // highest bit rate PPS may pick
+#define MFRC522_TCL_RETRIES    2 // R(NAK)s or retransmissions per block before giving up
+#define MFRC522_RATE_RECORDS   8 // cards whose negotiated bit rate is remembered
+
+/* Antenna and receiver tuning, see MFRC522_Tune */
+#define MFRC522_TUNE_ROUNDS      20 // activations of the reference card per candidate setting
+#define MFRC522_TUNING_ADDR      0x081C0000 // flash sector kept out of FLASH in the linker script
+#define MFRC522_TUNING_SECTOR    FLASH_SECTOR_11
+
+/* Diagnostics, the driver only counts errors and MFRC522_ReportErrors prints them */
+#define MFRC522_DIAGNOSTICS      1    // 0 leaves MFRC522_ReportErrors empty
+#define MFRC522_DIAG_INTERVAL_MS 5000 // at most one report per interval
+
+/* CRC_A backends (ISO14443-3 annex B) */
+#define MFRC522_CRC_SOFTWARE     0 // table driven, on the MCU
+#define MFRC522_CRC_HARDWARE     1 // STM32 CRC peripheral
+#define MFRC522_CRC_COPROCESSOR  2 // the reader's CalcCRC command (SPI round trip)
+#define MFRC522_CRC_BACKEND      MFRC522_CRC_SOFTWARE
 
 /* Status enumeration */
 typedef enum {
-	RFID_OK = 0, RFID_NOTAGERR, RFID_ERR, RFID_TIMEOUT,
+	RFID_OK = 0, RFID_NOTAGERR, RFID_ERR, RFID_TIMEOUT, RFID_COLLISION, RFID_BUSY,
+	RFID_CRC_ERR, // CRC_A of the answer does not match
+	RFID_PARITY_ERR, // ParityErr in ErrorReg
+	RFID_PROTOCOL_ERR, // ProtocolErr in ErrorReg, or an answer of the wrong length
+	RFID_OVERFLOW, // BufferOvfl in ErrorReg, or data that does not fit a buffer
+	RFID_TEMP_ERR, // TempErr in ErrorReg, the antenna drivers were switched off
+	RFID_BUS_ERR, // SPI transfer failed
+	RFID_STATUS_COUNT,
 } MFRC522_Status_t;
 
+/* Card UID, single (4), double (7) or triple (10) size (ISO14443-3 section 6.5.4) */
+#define MFRC522_UID_MAX_LEN 10
+
+typedef struct {
+	uint8_t size; // number of valid bytes in bytes[]
+	uint8_t bytes[MFRC522_UID_MAX_LEN];
+	uint8_t sak; // select acknowledge of the last cascade level
+} MFRC522_UID_t;
+
+/* SPI bus shared by one or more readers */
+typedef struct {
+	SPI_HandleTypeDef *spi;
+	SemaphoreHandle_t mutex; // held for the duration of a single transfer
+	StaticSemaphore_t mutex_buffer;
+	volatile TaskHandle_t dma_task; // task waiting for the DMA transfer
+	volatile HAL_StatusTypeDef dma_result;
+	// DMA bounce buffers, kept cache line aligned because the D-cache is enabled
+	uint8_t dma_tx[MFRC522_DMA_BUF_SIZE] __attribute__((aligned(32)));
+	uint8_t dma_rx[MFRC522_DMA_BUF_SIZE] __attribute__((aligned(32)));
+} MFRC522_Bus_t;
+
+/* Error counters of a reader, by status */
+typedef struct {
+	uint32_t errors[RFID_STATUS_COUNT];
+	uint32_t reported[RFID_STATUS_COUNT]; // counts at the last MFRC522_ReportErrors
+	uint32_t last_report; // HAL tick of the last report
+	uint8_t collision_bit; // CollPos of the last collision (1 to 32), 0 when not valid
+} MFRC522_Stats_t;
+
+/* Antenna and receiver settings of a reader, found by MFRC522_Tune */
+typedef struct {
+	uint8_t valid; // 1 once tuned, the defaults are used otherwise
+	uint8_t rf_cfg; // RFCfgReg, receiver gain
+	uint8_t cw_gs_p; // CWGsPReg, p-driver conductance without modulation
+	uint8_t mod_gs_p; // ModGsPReg, p-driver conductance during modulation
+	uint8_t gs_n; // GsNReg, n-driver conductance
+	uint8_t rx_threshold; // RxThresholdReg at 106 kbps
+} MFRC522_Tuning_t;
+
+/* One reader, the fields after irq_pin are driver state and start zeroed */
+typedef struct {
+	MFRC522_Bus_t *bus;
+	GPIO_TypeDef *cs_port;
+	uint16_t cs_pin;
+	GPIO_TypeDef *irq_port; // NULL polls the IRQ registers instead
+	uint16_t irq_pin;
+
+	SemaphoreHandle_t irq_semaphore; // given from the EXTI interrupt of irq_pin
+	StaticSemaphore_t irq_semaphore_buffer;
+	uint8_t shadow[64]; // host-owned registers, see MFRC522_SHADOW_MASK
+	uint64_t shadow_valid; // bit n is set once register n holds a known value
+	uint32_t shadow_saved; // SPI transactions avoided thanks to the shadow
+	uint32_t timeout_ms; // timeout programmed into the reader's timer
+	uint8_t command; // command started by StartCommand
+	uint8_t wait_irq; // IRQ bits that end it
+	uint8_t stream_rx; // the answer is drained from the FIFO on HiAlert
+	uint32_t command_start; // HAL tick when it was started
+	uint8_t auth_key; // key type Crypto1 is authenticated with, 0 when off
+	uint8_t auth_sector; // sector it is authenticated for
+	uint8_t auth_key_bytes[6]; // key it is authenticated with
+	MFRC522_UID_t auth_uid; // card it is authenticated to
+	MFRC522_Stats_t stats;
+	MFRC522_Tuning_t tuning; // loaded from flash by MFRC522_Init
+} MFRC522_Handle_t;
+
+/* ISO14443-4 (T=CL) session, filled in by MFRC522_ActivateTCL */
+typedef struct {
+	MFRC522_UID_t uid; // card the session belongs to
+	uint8_t ats[MFRC522_FIFO_SIZE]; // answer to select, without CRC_A
+	uint8_t ats_len;
+	uint16_t fsc; // largest frame the card accepts
+	uint8_t fwi; // frame waiting time integer
+	uint8_t sfgi; // start-up frame guard time integer
+	uint8_t tx_speed; // MFRC522_SPEED_x agreed with PPS, reader to card
+	uint8_t rx_speed; // card to reader
+	uint8_t block_num; // current block number, 0 or 1
+	uint8_t tx[MFRC522_TCL_FSD]; // frame buffers, including CRC_A
+	uint8_t rx[MFRC522_TCL_FSD];
+} MFRC522_TCL_t;
+
+/* Adaptive polling state of MFRC522_PresenceCheck, starts zeroed */
+typedef struct {
+	uint32_t interval_ms; // delay until the next check
+	uint32_t last_event; // HAL tick of the last check anything answered to
+	MFRC522_UID_t card; // card found by the last check, tracked by the next one
+	uint8_t tracking; // card is valid
+	uint8_t held; // the last check found the same card as the one before
+} MFRC522_Presence_t;
+
+/* Bit rate negotiated with a card, kept across activations */
+typedef struct {
+	MFRC522_UID_t uid;
+	uint8_t speed; // MFRC522_SPEED_x of the last activation, the faster direction
+	uint8_t max_speed; // highest rate PPS may still pick, lowered after failures
+} MFRC522_Rate_t;
+
+/* Phases of non-blocking card detection */
+typedef enum {
+	MFRC522_DETECT_REQUEST = 0,
+	MFRC522_DETECT_ANTICOLLISION,
+	MFRC522_DETECT_SELECT,
+	MFRC522_DETECT_HALT,
+	MFRC522_DETECT_DONE,
+} MFRC522_DetectState_t;
+
+/* Card detection context, see MFRC522_DetectStart and MFRC522_DetectStep */
+typedef struct {
+	MFRC522_DetectState_t state;
+	MFRC522_Status_t status; // result, valid once state is MFRC522_DETECT_DONE
+	MFRC522_UID_t *uid;
+	uint8_t pending; // a command of this phase is in flight
+	uint8_t keep_selected; // skip HALT after a successful select
+	uint8_t track; // uid is known, wake it with WUPA and select it without anticollision
+	uint8_t level; // cascade level, 0 to 2
+	uint8_t known_bits; // UID bits of this level resolved by anticollision
+	uint8_t buffer[9]; // SEL, NVB, 4 UID bytes, BCC and CRC_A
+	uint8_t response[MFRC522_MAX_LEN];
+	uint16_t response_bits;
+} MFRC522_Detect_t;
+
 /* Exported functions */
-extern void MFRC522_Init(void);
-extern uint8_t MFRC522_Version();
-extern MFRC522_Status_t MFRC522_CheckCard(uint8_t *id, uint8_t *type);
-extern MFRC522_Status_t MFRC522_CompareIDs(uint8_t *id1, uint8_t *id2);
+extern void MFRC522_InitBus(MFRC522_Bus_t *bus, SPI_HandleTypeDef *spi);
+extern void MFRC522_Init(MFRC522_Handle_t *reader);
+extern uint32_t MFRC522_CalibrateSPI(MFRC522_Handle_t **readers, uint8_t count);
+extern MFRC522_Status_t MFRC522_Tune(MFRC522_Handle_t *reader, MFRC522_UID_t *reference);
+extern MFRC522_Status_t MFRC522_SaveTuning(void);
+extern uint8_t MFRC522_Version(MFRC522_Handle_t *reader);
+extern uint32_t MFRC522_SavedTransactions(MFRC522_Handle_t *reader);
+extern void MFRC522_ReportErrors(MFRC522_Handle_t *reader);
+extern void MFRC522_SetTimeout(MFRC522_Handle_t *reader, uint32_t us);
+extern void MFRC522_SetFWI(MFRC522_Handle_t *reader, uint8_t fwi);
+extern MFRC522_Status_t MFRC522_CheckCard(MFRC522_Handle_t *reader, MFRC522_UID_t *uid);
+extern MFRC522_Status_t MFRC522_SelectCard(MFRC522_Handle_t *reader, MFRC522_UID_t *uid);
+extern void MFRC522_HaltCard(MFRC522_Handle_t *reader);
+extern MFRC522_Status_t MFRC522_TrackCard(MFRC522_Handle_t *reader, MFRC522_UID_t *uid);
+extern void MFRC522_DetectStart(MFRC522_Detect_t *ctx, MFRC522_UID_t *uid);
+extern void MFRC522_DetectTrack(MFRC522_Detect_t *ctx, MFRC522_UID_t *uid);
+extern MFRC522_Status_t MFRC522_DetectStep(MFRC522_Handle_t *reader, MFRC522_Detect_t *ctx);
+extern MFRC522_Status_t MFRC522_PresenceCheck(MFRC522_Handle_t *reader,
+        MFRC522_Presence_t *presence, MFRC522_UID_t *uid);
+extern void MFRC522_Sleep(MFRC522_Handle_t *reader);
+extern void MFRC522_Wake(MFRC522_Handle_t *reader);
+extern MFRC522_Status_t MFRC522_Inventory(MFRC522_Handle_t *reader, MFRC522_UID_t *uids,
+        uint8_t max_uids, uint8_t *count);
+extern void MFRC522_PollReaders(MFRC522_Handle_t **readers, uint8_t count, MFRC522_UID_t *uids,
+        MFRC522_Status_t *statuses);
+extern MFRC522_Status_t MFRC522_Authenticate(MFRC522_Handle_t *reader, uint8_t key_type,
+        uint8_t block, const uint8_t *key, MFRC522_UID_t *uid);
+extern MFRC522_Status_t MFRC522_AuthenticateSector(MFRC522_Handle_t *reader, uint8_t sector,
+        uint8_t key_type, const uint8_t *key, MFRC522_UID_t *uid);
+extern void MFRC522_StopCrypto(MFRC522_Handle_t *reader);
+extern MFRC522_Status_t MFRC522_ReadBlock(MFRC522_Handle_t *reader, uint8_t block, uint8_t *data);
+extern MFRC522_Status_t MFRC522_WriteBlock(MFRC522_Handle_t *reader, uint8_t block,
+        const uint8_t *data);
+extern MFRC522_Status_t MFRC522_ReadSector(MFRC522_Handle_t *reader, uint8_t sector,
+        uint8_t key_type, const uint8_t *key, MFRC522_UID_t *uid, uint8_t *data);
+extern MFRC522_Status_t MFRC522_WriteSector(MFRC522_Handle_t *reader, uint8_t sector,
+        uint8_t key_type, const uint8_t *key, MFRC522_UID_t *uid, const uint8_t *data);
+extern MFRC522_Status_t MFRC522_ReadValue(MFRC522_Handle_t *reader, uint8_t block, int32_t *value);
+extern MFRC522_Status_t MFRC522_WriteValue(MFRC522_Handle_t *reader, uint8_t block, int32_t value);
+extern MFRC522_Status_t MFRC522_ValueOperation(MFRC522_Handle_t *reader, uint8_t command,
+        uint8_t block, int32_t operand);
+extern MFRC522_Status_t MFRC522_TransferValue(MFRC522_Handle_t *reader, uint8_t block);
+extern uint8_t MFRC522_BlockSector(uint8_t block);
+extern MFRC522_Status_t MFRC522_ActivateTCL(MFRC522_Handle_t *reader, MFRC522_UID_t *uid,
+        MFRC522_TCL_t *tcl);
+extern MFRC522_Status_t MFRC522_ExchangeAPDU(MFRC522_Handle_t *reader, MFRC522_TCL_t *tcl,
+        const uint8_t *apdu, uint16_t len, uint8_t *resp, uint16_t resp_size, uint16_t *resp_len);
+extern void MFRC522_DeselectTCL(MFRC522_Handle_t *reader, MFRC522_TCL_t *tcl);
+extern uint8_t MFRC522_CardSpeed(MFRC522_UID_t *uid);
+extern MFRC522_Status_t MFRC522_CompareIDs(MFRC522_UID_t *id1, MFRC522_UID_t *id2);
 extern void MFRC522_PrettyPrint(unsigned char *in, unsigned int size, char **out);
 
 /*
@@ -95,6 +336,54 @@ extern void MFRC522_PrettyPrint(unsigned char *in, unsigned int size, char **out
 #define MFRC522_TEST_DAC2_REG       0x3a // defines the test value for TestDAC2
 #define MFRC522_TEST_ADC_REG        0x3b // shows the value of ADC I and Q channels
 
+/*
+ * Register bits (section 9.3)
+ */
+
+/* ComIEnReg and ComIrqReg */
+#define MFRC522_IRQ_TIMER           0x01 // TimerIRq, the timer ran out
+#define MFRC522_IRQ_ERR             0x02 // ErrIRq, an ErrorReg bit is set
+#define MFRC522_IRQ_LO_ALERT        0x04 // LoAlertIRq, FIFO down to the water level
+#define MFRC522_IRQ_HI_ALERT        0x08 // HiAlertIRq, FIFO up to 64 - water level
+#define MFRC522_IRQ_IDLE            0x10 // IdleIRq, the command ended
+#define MFRC522_IRQ_RX              0x20 // RxIRq, end of a received frame
+#define MFRC522_IRQ_TX              0x40 // TxIRq, last bit sent
+#define MFRC522_IRQ_ALL             0x7F
+#define MFRC522_IRQ_INV             0x80 // IRqInv in ComIEnReg (pin active low), Set1 in ComIrqReg
+
+/* DivIEnReg and DivIrqReg */
+#define MFRC522_DIVIRQ_CRC          0x04 // CRCIRq, CalcCRC is done
+#define MFRC522_DIVIEN_PUSH_PULL    0x80 // IRQPushPull
+
+/* ErrorReg */
+#define MFRC522_ERR_PROTOCOL        0x01 // ProtocolErr, SOF incorrect
+#define MFRC522_ERR_PARITY          0x02 // ParityErr
+#define MFRC522_ERR_CRC             0x04 // CRCErr, only with RxCRCEn
+#define MFRC522_ERR_COLL            0x08 // CollErr, bit collision
+#define MFRC522_ERR_BUFFER_OVFL     0x10 // BufferOvfl, FIFO full
+#define MFRC522_ERR_TEMP            0x40 // TempErr, antenna drivers switched off
+#define MFRC522_ERR_WR              0x80 // WrErr, FIFO written at the wrong time
+
+/* Status1Reg and Status2Reg */
+#define MFRC522_STATUS1_LO_ALERT    0x01
+#define MFRC522_STATUS1_HI_ALERT    0x02
+#define MFRC522_STATUS2_CRYPTO1_ON  0x08 // MFCrypto1On
+
+/* CommandReg, FIFOLevelReg, ControlReg, BitFramingReg and CollReg */
+#define MFRC522_COMMAND_POWER_DOWN  0x10 // soft power-down, reads 1 until the oscillator is stable
+#define MFRC522_FIFO_FLUSH          0x80 // FlushBuffer
+#define MFRC522_FIFO_LEVEL_MASK     0x7F
+#define MFRC522_CONTROL_RX_LAST_BITS 0x07 // valid bits of the last received byte, 0 for all
+#define MFRC522_BIT_FRAMING_START_SEND 0x80 // StartSend, starts the transmission of Transceive
+#define MFRC522_COLL_POS_NOT_VALID  0x20 // CollPosNotValid, no collision or outside of CollPos
+#define MFRC522_COLL_POS_MASK       0x1F // CollPos, 0 stands for bit 32
+
+/* ModeReg, TxControlReg, TxASKReg and TModeReg */
+#define MFRC522_MODE_DEFAULT        0x3D // TxWaitRF, PolMFin and CRCPreset 6363h
+#define MFRC522_TX_CONTROL_RF_EN    0x03 // Tx1RFEn and Tx2RFEn, the field is on
+#define MFRC522_TX_ASK_FORCE_100    0x40 // Force100ASK
+#define MFRC522_T_MODE_AUTO         0x80 // TAuto, the timer starts at the end of the transmission
+
 /*
  * Command set (chapter 10)
  */
@@ -116,6 +405,10 @@ extern void MFRC522_PrettyPrint(unsigned char *in, unsigned int size, char **out
 #define MFRC522_PICC_REQ_ALL        0x52
 #define MFRC522_PICC_ANTICOLLISION  0x93
 #define MFRC522_PICC_SELECT_TAG     0x93
+#define MFRC522_PICC_SEL_CL1        0x93 // anticollision / select, cascade level 1
+#define MFRC522_PICC_SEL_CL2        0x95 // anticollision / select, cascade level 2
+#define MFRC522_PICC_SEL_CL3        0x97 // anticollision / select, cascade level 3
+#define MFRC522_PICC_CASCADE_TAG    0x88 // marks an incomplete UID in a cascade level
 #define MFRC522_PICC_AUTHENT_1A     0x60 // authentication key A
 #define MFRC522_PICC_AUTHENT_1B     0x61 // authentication key B
 #define MFRC522_PICC_READ           0x30 // read block
@@ -125,7 +418,15 @@ extern void MFRC522_PrettyPrint(unsigned char *in, unsigned int size, char **out
 #define MFRC522_PICC_RESTORE        0xC2 // transfer block data to the buffer
 #define MFRC522_PICC_TRANSFER       0xB0 // save the data in the buffer
 #define MFRC522_PICC_HALT           0x50 // sleep
+#define MFRC522_PICC_RATS           0xE0 // request for answer to select (ISO14443-4)
+#define MFRC522_PICC_PPS            0xD0 // protocol and parameter selection, CID 0
 
-#define MFRC522_MAX_LEN             16
+/* ISO14443-4 block PCBs (section 7.1.1), without CID and NAD */
+#define MFRC522_TCL_I_BLOCK         0x02 // I-block, OR with the block number
+#define MFRC522_TCL_CHAINING        0x10 // more I-blocks follow
+#define MFRC522_TCL_R_ACK           0xA2 // R(ACK), OR with the block number
+#define MFRC522_TCL_R_NAK           0xB2 // R(NAK), OR with the block number
+#define MFRC522_TCL_S_DESELECT      0xC2
+#define MFRC522_TCL_S_WTX           0xF2 // waiting time extension
 
 #endif /* INC_MFRC522_H_ */
@@ -0,0 +1,22 @@
+/*
+ * Delta sync of the access list over UART
+ */
+
+#ifndef INC_SYNC_H_
+#define INC_SYNC_H_
+
+/* Includes */
+#include "main.h"
+#include "access.h"
+
+/* Configuration */
+#define SYNC_BUFFER_SIZE 1024 // received bytes waiting for the sync task
+#define SYNC_TIMEOUT_MS  500  // longest pause within a batch before it is dropped
+
+/* Exported functions */
+extern void Sync_Init(UART_HandleTypeDef *uart, IRQn_Type irq);
+extern void Sync_Run(Access_List_t *list);
+extern void Sync_UARTHandler(void);
+extern void Sync_Write(const uint8_t *data, uint32_t size);
+
+#endif /* INC_SYNC_H_ */
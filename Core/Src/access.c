@@ -0,0 +1,972 @@
+/*
+ * Access list of badges, looked up by card UID
+ *
+ * Badges live in an open addressing table. A UID may only be stored in the
+ * ACCESS_MAX_PROBES slots that follow its hash, and a lookup always reads
+ * all of them and compares without exiting early. Every lookup therefore
+ * costs the same, however full the table is and whether or not the badge
+ * is known, and the window is ACCESS_MAX_PROBES cache lines in a row.
+ *
+ * The table can also be an image in QSPI flash, mapped at ACCESS_QSPI_BASE.
+ * Lookups then read it in place, so a list of millions of badges costs no
+ * internal RAM. Startup only checks the header and copies the image's Bloom
+ * filter, Access_Verify checks the rest later in the background.
+ *
+ * A Bloom filter in internal RAM can sit in front of the table. Most cards
+ * shown at a door are unknown, and the filter turns nearly all of them away
+ * without reading the table. Only badges that pass it cost a full lookup.
+ *
+ * An access list keeps two such tables. A new list is staged into the one
+ * lookups do not use and checked, then a single store makes it active.
+ * Lookups never wait for an update and never see a half written list. The
+ * list is updated from one task only.
+ *
+ * Delta batches change a few badges at a time. The inactive bank is always
+ * one batch behind the active one, so a batch is applied by replaying the
+ * previous batch and then the new one on it, without copying the list.
+ */
+
+/* Includes */
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "main.h"
+#include "cmsis_os.h"
+#include "access.h"
+#include "stm32f769i_discovery_qspi.h"
+
+/*
+ * CRC-32 lookup table (polynomial 0x04C11DB7, not reflected), the algorithm
+ * the STM32 CRC unit uses by default. The unit itself is left to the MFRC522
+ * driver, which sets it up for CRC_A.
+ */
+#define ACCESS_CRC_INIT     0xFFFFFFFF
+#define ACCESS_CRC_BIT(c)   (((c) << 1) ^ (((c) >> 31) * 0x04C11DB7u))
+#define ACCESS_CRC_ENTRY(n) ACCESS_CRC_BIT(ACCESS_CRC_BIT(ACCESS_CRC_BIT(ACCESS_CRC_BIT( \
+	ACCESS_CRC_BIT(ACCESS_CRC_BIT(ACCESS_CRC_BIT(ACCESS_CRC_BIT((uint32_t) (n) << 24))))))))
+#define ACCESS_CRC_ROW4(n)  ACCESS_CRC_ENTRY(n), ACCESS_CRC_ENTRY(n + 1), ACCESS_CRC_ENTRY(n + 2), \
+	ACCESS_CRC_ENTRY(n + 3)
+#define ACCESS_CRC_ROW16(n) ACCESS_CRC_ROW4(n), ACCESS_CRC_ROW4(n + 4), ACCESS_CRC_ROW4(n + 8), \
+	ACCESS_CRC_ROW4(n + 12)
+#define ACCESS_CRC_ROW64(n) ACCESS_CRC_ROW16(n), ACCESS_CRC_ROW16(n + 16), ACCESS_CRC_ROW16(n + 32), \
+	ACCESS_CRC_ROW16(n + 48)
+
+const uint32_t Access_CRC_Table[256] = { ACCESS_CRC_ROW64(0), ACCESS_CRC_ROW64(64), ACCESS_CRC_ROW64(128),
+        ACCESS_CRC_ROW64(192) };
+
+_Static_assert(sizeof(Access_Record_t) == 32, "A record has to fill exactly one cache line");
+
+/* Private function definitions */
+uint32_t Access_Hash(const uint8_t *uid, uint8_t uid_size);
+void Access_Key(Access_Record_t *key, const uint8_t *uid, uint8_t uid_size);
+uint32_t Access_Matches(const Access_Record_t *slot, const Access_Record_t *key);
+int32_t Access_Find(Access_Table_t *table, const uint8_t *uid, uint8_t uid_size);
+void Access_EnableCycles(void);
+void Access_FilterBits(Access_Table_t *table, const uint8_t *uid, uint8_t uid_size, uint32_t *bits);
+uint8_t Access_FilterCheck(Access_Table_t *table, const uint8_t *uid, uint8_t uid_size);
+void Access_FilterAdd(Access_Table_t *table, const uint8_t *uid, uint8_t uid_size);
+void Access_AttachFilter(Access_Table_t *table, uint32_t *filter, uint32_t bits);
+uint32_t Access_FilterSize(const Access_List_t *list, uint32_t count);
+uint32_t Access_CRC32(uint32_t crc, const void *data, uint32_t size);
+uint32_t Access_StageBank(Access_List_t *list);
+Access_Status_t Access_RebuildBatch(Access_List_t *list, const Access_BatchHeader_t *header,
+        const uint8_t *changes);
+Access_Status_t Access_ApplyChanges(Access_Table_t *table, const Access_Delta_t *changes, uint8_t count);
+Access_Status_t Access_CopyTable(Access_Table_t *to, Access_Record_t *store, uint32_t capacity,
+        const Access_Table_t *from);
+
+/*
+ * Sets up an empty table on capacity slots, a power of two. Keep the load
+ * below about 3/4, a badge that finds no free slot in its window is refused.
+ */
+Access_Status_t Access_Init(Access_Table_t *table, Access_Record_t *slots, uint32_t capacity) {
+	if (capacity < ACCESS_MAX_PROBES || (capacity & (capacity - 1))) {
+		return ACCESS_ERR;
+	}
+
+	memset(slots, 0, capacity * sizeof(Access_Record_t));
+	table->slots = slots;
+	table->mask = capacity - 1;
+	table->count = 0;
+	table->version = 0;
+	table->readonly = 0;
+	table->verified = 0;
+	table->damaged = 0;
+	table->image = NULL;
+	table->last_cycles = 0;
+	table->max_cycles = 0;
+	table->filter = NULL;
+
+	Access_EnableCycles();
+
+	return ACCESS_OK;
+}
+
+/*
+ * Maps the QSPI flash and uses the image at offset as the table. Only the
+ * header is checked, so startup does not have to read the whole image, call
+ * Access_Verify for the rest. The slots are never copied. Returns
+ * ACCESS_NOTFOUND if there is no image and ACCESS_ERR if it is damaged.
+ */
+Access_Status_t Access_Map(Access_Table_t *table, uint32_t offset) {
+	const Access_Image_t *image = (const Access_Image_t*) (ACCESS_QSPI_BASE + offset);
+
+	if (BSP_QSPI_Init() != QSPI_OK || BSP_QSPI_EnableMemoryMappedMode() != QSPI_OK) {
+		printf("[ERROR]: (Map) Failed to map the QSPI flash\r\n");
+		return ACCESS_ERR;
+	}
+
+	// The D-cache may still hold what was mapped before
+	SCB_InvalidateDCache_by_Addr((uint32_t*) image, sizeof(Access_Image_t));
+
+	if (image->magic != ACCESS_IMAGE_MAGIC) {
+		return ACCESS_NOTFOUND;
+	}
+
+	uint32_t space = MX25L512_FLASH_SIZE - offset - sizeof(Access_Image_t);
+
+	if (image->header_crc != Access_CRC32(ACCESS_CRC_INIT, image, offsetof(Access_Image_t, header_crc))
+	        || image->capacity < ACCESS_MAX_PROBES || (image->capacity & (image->capacity - 1))
+	        || (image->filter_bits
+	                && (image->filter_bits < 256 || (image->filter_bits & (image->filter_bits - 1))))
+	        || image->filter_bits / 8 > space
+	        || image->capacity > (space - image->filter_bits / 8) / sizeof(Access_Record_t)) {
+		printf("[ERROR]: (Map) Access list image header is damaged\r\n");
+		return ACCESS_ERR;
+	}
+
+	table->slots = (Access_Record_t*) ((const uint8_t*) (image + 1) + image->filter_bits / 8);
+	table->mask = image->capacity - 1;
+	table->count = image->count;
+	table->version = image->version;
+	table->readonly = 1;
+	table->verified = 0;
+	table->damaged = 0;
+	table->image = image;
+	table->last_cycles = 0;
+	table->max_cycles = 0;
+	table->filter = NULL;
+
+	Access_EnableCycles();
+
+	return ACCESS_OK;
+}
+
+/*
+ * Checks the filter and slots of a mapped image against its CRC. This reads
+ * the whole image, so run it in the background once lookups are going. A
+ * damaged image refuses every badge from then on.
+ */
+Access_Status_t Access_Verify(Access_Table_t *table) {
+	const Access_Image_t *image = table->image;
+
+	if (image != NULL && !table->verified) {
+		uint32_t size = image->filter_bits / 8 + image->capacity * sizeof(Access_Record_t);
+
+		table->damaged = (image->crc != Access_CRC32(ACCESS_CRC_INIT, image + 1, size));
+		table->verified = 1;
+
+		if (table->damaged) {
+			printf("[ERROR]: (Verify) Access list image is damaged, refusing every badge\r\n");
+		}
+	}
+
+	return table->damaged ? ACCESS_ERR : ACCESS_OK;
+}
+
+/*
+ * Writes table and its filter as an image to QSPI flash at offset. The flash
+ * has to leave memory mapped mode for this, so no mapped table may be used
+ * until it returns, and table itself has to be in RAM. Erasing takes a while
+ * for big tables, only call it while setting up. The flash is mapped again
+ * afterwards.
+ */
+Access_Status_t Access_SaveImage(const Access_Table_t *table, uint32_t offset, uint32_t version) {
+	Access_Image_t image;
+	uint32_t size = (table->mask + 1) * sizeof(Access_Record_t);
+	uint32_t filter_size = table->filter ? (table->filter_mask + 1) / 8 : 0;
+	uint8_t status = QSPI_OK;
+
+	// Filters under 256 bits would leave the slots off their cache lines
+	if (filter_size < 32) {
+		filter_size = 0;
+	}
+
+	// A mapped table cannot be read while the flash is written
+	if (table->readonly || offset % MX25L512_SUBSECTOR_SIZE
+	        || sizeof(Access_Image_t) + filter_size + size > MX25L512_FLASH_SIZE - offset) {
+		return ACCESS_ERR;
+	}
+
+	memset(&image, 0, sizeof(image));
+	image.magic = ACCESS_IMAGE_MAGIC;
+	image.version = version;
+	image.capacity = table->mask + 1;
+	image.count = table->count;
+	image.filter_bits = filter_size * 8;
+	image.crc = Access_CRC32(Access_CRC32(ACCESS_CRC_INIT, table->filter, filter_size), table->slots, size);
+	image.header_crc = Access_CRC32(ACCESS_CRC_INIT, &image, offsetof(Access_Image_t, header_crc));
+
+	// Initializing the flash again leaves memory mapped mode
+	if (BSP_QSPI_Init() != QSPI_OK) {
+		status = QSPI_ERROR;
+	}
+
+	for (uint32_t addr = offset; addr < offset + sizeof(image) + filter_size + size && status == QSPI_OK;
+	        addr += MX25L512_SUBSECTOR_SIZE) {
+		status = BSP_QSPI_Erase_Block(addr);
+	}
+
+	if (status == QSPI_OK && filter_size) {
+		status = BSP_QSPI_Write((uint8_t*) table->filter, offset + sizeof(image), filter_size);
+	}
+
+	if (status == QSPI_OK) {
+		status = BSP_QSPI_Write((uint8_t*) table->slots, offset + sizeof(image) + filter_size, size);
+	}
+
+	// The header goes last, an interrupted write leaves no valid image behind
+	if (status == QSPI_OK) {
+		status = BSP_QSPI_Write((uint8_t*) &image, offset, sizeof(image));
+	}
+
+	if (BSP_QSPI_EnableMemoryMappedMode() != QSPI_OK) {
+		status = QSPI_ERROR;
+	}
+
+	SCB_InvalidateDCache_by_Addr((uint32_t*) (ACCESS_QSPI_BASE + offset),
+	        (sizeof(image) + filter_size + size + 31) & ~31);
+
+	if (status != QSPI_OK) {
+		printf("[ERROR]: (SaveImage) Failed to write the access list image\r\n");
+		return ACCESS_ERR;
+	}
+
+	return ACCESS_OK;
+}
+
+/* Adds a badge or replaces the one with the same UID, only for tables in RAM */
+Access_Status_t Access_Insert(Access_Table_t *table, const Access_Record_t *record) {
+	if (table == NULL || table->readonly || record->uid_size == 0 || record->uid_size > ACCESS_UID_MAX_LEN) {
+		return ACCESS_ERR;
+	}
+
+	int32_t index = Access_Find(table, record->uid, record->uid_size);
+
+	if (index < 0) {
+		uint32_t start = Access_Hash(record->uid, record->uid_size);
+
+		for (uint32_t i = 0; i < ACCESS_MAX_PROBES; i++) {
+			uint32_t slot = (start + i) & table->mask;
+
+			if (!(table->slots[slot].flags & ACCESS_FLAG_USED)) {
+				index = slot;
+				table->count++;
+				break;
+			}
+		}
+	}
+
+	if (index < 0) {
+		return ACCESS_FULL;
+	}
+
+	Access_Key(&table->slots[index], record->uid, record->uid_size);
+	table->slots[index].flags = record->flags | ACCESS_FLAG_USED;
+	table->slots[index].groups = record->groups;
+	table->slots[index].valid_from = record->valid_from;
+	table->slots[index].valid_until = record->valid_until;
+
+	if (table->filter) {
+		Access_FilterAdd(table, record->uid, record->uid_size);
+	}
+
+	return ACCESS_OK;
+}
+
+/*
+ * Removes a badge, lookups read the whole window so the slot can simply be
+ * freed. Its bits stay set in the filter, rebuild it after many removals.
+ */
+Access_Status_t Access_Remove(Access_Table_t *table, const uint8_t *uid, uint8_t uid_size) {
+	if (table->readonly) {
+		return ACCESS_ERR;
+	}
+
+	int32_t index = Access_Find(table, uid, uid_size);
+
+	if (index < 0) {
+		return ACCESS_NOTFOUND;
+	}
+
+	memset(&table->slots[index], 0, sizeof(Access_Record_t));
+	table->count--;
+
+	return ACCESS_OK;
+}
+
+/*
+ * Returns the badge with this UID or NULL. Badges that pass the filter take
+ * the same number of cycles whether they are known or not.
+ */
+const Access_Record_t* Access_Lookup(Access_Table_t *table, const uint8_t *uid, uint8_t uid_size) {
+	if (table->filter && !Access_FilterCheck(table, uid, uid_size)) {
+		table->filter_rejects++;
+		return NULL;
+	}
+
+	int32_t index = Access_Find(table, uid, uid_size);
+
+	if (index < 0) {
+		if (table->filter) {
+			table->filter_misses++;
+		}
+
+		return NULL;
+	}
+
+	return &table->slots[index];
+}
+
+/*
+ * Puts a Bloom filter of bits bits, a power of two, in front of the table
+ * and fills it with the stored badges. Keep the filter in internal RAM. At
+ * about 10 bits per badge only 1 in 100 unknown badges gets past it. This
+ * reads every slot, images in QSPI flash bring their filter along instead.
+ */
+Access_Status_t Access_SetFilter(Access_Table_t *table, uint32_t *filter, uint32_t bits) {
+	if (bits < 32 || (bits & (bits - 1))) {
+		return ACCESS_ERR;
+	}
+
+	memset(filter, 0, bits / 8);
+	Access_AttachFilter(table, filter, bits);
+
+	for (uint32_t i = 0; i <= table->mask; i++) {
+		const Access_Record_t *slot = &table->slots[i];
+
+		if (slot->flags & ACCESS_FLAG_USED) {
+			Access_FilterAdd(table, slot->uid, slot->uid_size);
+		}
+	}
+
+	return ACCESS_OK;
+}
+
+/* Prints how well the filter works, at most once per ACCESS_REPORT_INTERVAL_MS */
+void Access_ReportFilter(Access_Table_t *table) {
+	uint32_t unknown = table->filter_rejects + table->filter_misses;
+
+	if (!table->filter || unknown == table->reported
+	        || HAL_GetTick() - table->last_report < ACCESS_REPORT_INTERVAL_MS) {
+		return;
+	}
+
+	table->last_report = HAL_GetTick();
+	table->reported = unknown;
+
+	// False positive rate in 0.1 %
+	uint32_t rate = (uint32_t) (((uint64_t) table->filter_misses * 1000) / unknown);
+
+	printf("Access filter: %lu unknown badges, %lu.%lu %% false positives, check %lu cycles, "
+	        "lookup up to %lu cycles\r\n", unknown, rate / 10, rate % 10, table->filter_cycles,
+	        table->max_cycles);
+}
+
+/*
+ * Sets up an access list. Bank 0 uses the image in QSPI flash, or an empty
+ * table in its store if there is none, in which case ACCESS_NOTFOUND is
+ * returned. Call it before the scheduler starts, and Access_Verify on bank 0
+ * once it runs.
+ */
+Access_Status_t Access_ListInit(Access_List_t *list) {
+	memset(list->banks, 0, sizeof(list->banks));
+	memset(list->readers, 0, sizeof(list->readers));
+	memset(&list->staged, 0, sizeof(list->staged));
+	memset(&list->last, 0, sizeof(list->last));
+	memset(list->seeded, 0, sizeof(list->seeded));
+	list->active = 0;
+	list->swaps = 0;
+	list->swap_cycles = 0;
+	list->max_pause_cycles = 0;
+
+	Access_Table_t *table = &list->banks[0];
+	Access_Status_t status = Access_Map(table, ACCESS_IMAGE_OFFSET);
+
+	if (status != ACCESS_OK && Access_Init(table, list->stores[0], list->capacity) != ACCESS_OK) {
+		return ACCESS_ERR;
+	}
+
+	if (list->filters[0] == NULL) {
+		return status;
+	}
+
+	// Copy the image's filter, only an image without one that fits has to be read through
+	if (table->image && table->image->filter_bits && table->image->filter_bits <= list->filter_bits) {
+		memcpy(list->filters[0], table->image + 1, table->image->filter_bits / 8);
+		Access_AttachFilter(table, list->filters[0], table->image->filter_bits);
+	} else {
+		Access_SetFilter(table, list->filters[0], Access_FilterSize(list, table->count));
+	}
+
+	return status;
+}
+
+/*
+ * Starts staging an empty list of the given version into the inactive bank
+ * and returns its table, fill it with Access_Insert and call Access_Commit.
+ * Waits for lookups that still read the bank from before the last swap.
+ */
+Access_Table_t* Access_Stage(Access_List_t *list, uint32_t version) {
+	uint32_t bank = Access_StageBank(list);
+
+	memset(&list->staged, 0, sizeof(list->staged));
+	list->staged.version = version;
+	list->seeded[bank] = 0;
+
+	if (Access_Init(&list->banks[bank], list->stores[bank], list->capacity) != ACCESS_OK) {
+		return NULL;
+	}
+
+	return &list->banks[bank];
+}
+
+/*
+ * Starts staging a whole image into the inactive bank. Pass its filter and
+ * slots with Access_StageWrite in any order, Access_Commit checks them
+ * against the CRC in the header.
+ */
+Access_Status_t Access_StageImage(Access_List_t *list, const Access_Image_t *image) {
+	uint32_t bank = !list->active;
+
+	if (image->magic != ACCESS_IMAGE_MAGIC
+	        || image->header_crc != Access_CRC32(ACCESS_CRC_INIT, image, offsetof(Access_Image_t, header_crc))
+	        || image->capacity > list->capacity
+	        || (image->filter_bits && (image->filter_bits < 256 || (image->filter_bits & (image->filter_bits - 1))
+	                || image->filter_bits > list->filter_bits || list->filters[bank] == NULL))) {
+		return ACCESS_ERR;
+	}
+
+	bank = Access_StageBank(list);
+	list->seeded[bank] = 0;
+
+	if (Access_Init(&list->banks[bank], list->stores[bank], image->capacity) != ACCESS_OK) {
+		return ACCESS_ERR;
+	}
+
+	list->staged = *image;
+	list->banks[bank].count = image->count;
+
+	return ACCESS_OK;
+}
+
+/*
+ * Copies size bytes of the staged image, starting offset bytes after its
+ * header. The filter goes to the bank's filter, the slots to its store.
+ */
+Access_Status_t Access_StageWrite(Access_List_t *list, uint32_t offset, const void *data, uint32_t size) {
+	uint32_t bank = !list->active;
+	uint32_t filter_size = list->staged.filter_bits / 8;
+	uint32_t total = filter_size + list->staged.capacity * sizeof(Access_Record_t);
+	const uint8_t *bytes = data;
+
+	if (list->staged.magic != ACCESS_IMAGE_MAGIC || size > total || offset > total - size) {
+		return ACCESS_ERR;
+	}
+
+	if (offset < filter_size) {
+		uint32_t part = (size < filter_size - offset) ? size : filter_size - offset;
+
+		memcpy((uint8_t*) list->filters[bank] + offset, bytes, part);
+		offset += part;
+		bytes += part;
+		size -= part;
+	}
+
+	memcpy((uint8_t*) list->stores[bank] + offset - filter_size, bytes, size);
+
+	return ACCESS_OK;
+}
+
+/*
+ * Checks the staged list and makes it active. A staged image has to match
+ * its CRC, and the version has to be newer than the active one. Lookups
+ * already running finish on the old bank, the next ones use the new one.
+ */
+Access_Status_t Access_Commit(Access_List_t *list) {
+	uint32_t bank = !list->active;
+	Access_Table_t *table = &list->banks[bank];
+
+	if (list->staged.version <= list->banks[list->active].version) {
+		return ACCESS_ERR;
+	}
+
+	if (list->staged.magic == ACCESS_IMAGE_MAGIC) {
+		uint32_t filter_size = list->staged.filter_bits / 8;
+		uint32_t crc = Access_CRC32(ACCESS_CRC_INIT, list->filters[bank], filter_size);
+
+		if (list->staged.crc != Access_CRC32(crc, table->slots, (table->mask + 1) * sizeof(Access_Record_t))) {
+			printf("[ERROR]: (Commit) Staged access list image is damaged\r\n");
+			return ACCESS_ERR;
+		}
+
+		if (filter_size) {
+			Access_AttachFilter(table, list->filters[bank], list->staged.filter_bits);
+		}
+	}
+
+	table->version = list->staged.version;
+
+	// A bank changed by delta batches kept its filter up to date on the way, unless it outgrew it
+	if (list->filters[bank] && (table->filter != list->filters[bank]
+	        || table->filter_mask + 1 < Access_FilterSize(list, table->count))) {
+		Access_SetFilter(table, list->filters[bank], Access_FilterSize(list, table->count));
+	}
+
+	// Everything above is visible before the bank is, the store is the only step lookups see
+	uint32_t start_cycles = DWT->CYCCNT;
+	__atomic_store_n(&list->active, bank, __ATOMIC_SEQ_CST);
+	list->swap_cycles = DWT->CYCCNT - start_cycles;
+	list->swaps++;
+
+	printf("Access list v%lu active, swap took %lu cycles, lookups held up to %lu cycles\r\n",
+	        table->version, list->swap_cycles, list->max_pause_cycles);
+
+	// Nothing may be staged into the bank that is now active
+	memset(&list->staged, 0, sizeof(list->staged));
+
+	return ACCESS_OK;
+}
+
+/*
+ * Checks a delta batch received from the host and applies it. The work is
+ * proportional to the batch. Only the first batch after booting from an
+ * image, after staging a whole list or after a failed batch copies the list
+ * once. Coming from an image, the store behind the image gets the copy too,
+ * so both banks are seeded and the batch after the swap applies only its
+ * changes. A batch that is already applied is accepted again, so the host
+ * can resend it when the reply got lost. A batch from version 0 starts a new
+ * list in RAM with just its badges, which also replaces a damaged image.
+ */
+Access_Status_t Access_ApplyBatch(Access_List_t *list, const uint8_t *batch, uint32_t size) {
+	Access_BatchHeader_t header;
+	uint32_t crc;
+
+	if (size < sizeof(header) + sizeof(crc)) {
+		return ACCESS_ERR;
+	}
+
+	memcpy(&header, batch, sizeof(header));
+	memcpy(&crc, batch + size - sizeof(crc), sizeof(crc));
+
+	if (header.magic != ACCESS_BATCH_MAGIC || header.count > ACCESS_BATCH_MAX
+	        || size != sizeof(header) + header.count * sizeof(Access_Delta_t) + sizeof(crc)
+	        || crc != Access_CRC32(ACCESS_CRC_INIT, batch, size - sizeof(crc))) {
+		return ACCESS_ERR;
+	}
+
+	const Access_Table_t *active = &list->banks[list->active];
+
+	if (header.count == 0 || (header.to_version == active->version && !active->damaged)) {
+		return ACCESS_OK;
+	}
+
+	if (header.to_version <= header.from_version) {
+		return ACCESS_ERR;
+	}
+
+	if (header.from_version == 0) {
+		return Access_RebuildBatch(list, &header, batch + sizeof(header));
+	}
+
+	// A damaged image has no version to build on, only a batch from version 0 replaces it
+	if (active->damaged || header.from_version != active->version) {
+		return ACCESS_ERR;
+	}
+
+	uint32_t bank = Access_StageBank(list);
+	Access_Table_t *table = &list->banks[bank];
+
+	// The bank left the image, take over the copy of it its store got when seeding
+	if (table->image && list->seeded[bank]) {
+		table->slots = list->stores[bank];
+		table->mask = list->capacity - 1;
+		table->readonly = 0;
+		table->image = NULL;
+		list->seeded[bank] = 0;
+	}
+
+	uint8_t in_store = (table->slots == list->stores[bank]);
+	uint8_t synced = in_store && table->version == active->version;
+
+	// Catch up with the batch that made the active bank
+	if (!synced && in_store && list->last.count && table->version == list->last.from_version
+	        && list->last.to_version == active->version) {
+		synced = (Access_ApplyChanges(table, list->last_changes, list->last.count) == ACCESS_OK);
+	}
+
+	if (!synced) {
+		if (Access_CopyTable(table, list->stores[bank], list->capacity, active) != ACCESS_OK) {
+			table->version = 0;
+			return ACCESS_FULL;
+		}
+
+		// Same badges, so the active filter fits as it is and commit does not walk the copy
+		if (active->filter && list->filters[bank]) {
+			memcpy(list->filters[bank], active->filter, (active->filter_mask + 1) / 8);
+			Access_AttachFilter(table, list->filters[bank], active->filter_mask + 1);
+		}
+
+		// Lookups read the image, not the store behind it, so that can be seeded now
+		if (active->image && !list->seeded[list->active]) {
+			memcpy(list->stores[list->active], table->slots, list->capacity * sizeof(Access_Record_t));
+			list->seeded[list->active] = 1;
+		}
+	}
+
+	// The last batch is in both banks now, keep this one for the other bank instead
+	memset(&list->last, 0, sizeof(list->last));
+	memcpy(list->last_changes, batch + sizeof(header), header.count * sizeof(Access_Delta_t));
+
+	Access_Status_t status = Access_ApplyChanges(table, list->last_changes, header.count);
+
+	memset(&list->staged, 0, sizeof(list->staged));
+	list->staged.version = header.to_version;
+
+	if (status == ACCESS_OK) {
+		status = Access_Commit(list);
+	}
+
+	if (status != ACCESS_OK) {
+		// Neither version anymore, the next batch copies the list again
+		table->version = 0;
+		return status;
+	}
+
+	list->last = header;
+
+	return ACCESS_OK;
+}
+
+/*
+ * Access_Grant on the active bank of an access list. The bank is pinned for
+ * the lookup so it cannot be staged over meanwhile. If a swap comes in while
+ * pinning, the lookup simply picks again, it never waits for the update.
+ */
+uint8_t Access_ListGrant(Access_List_t *list, const uint8_t *uid, uint8_t uid_size, uint32_t groups,
+        uint32_t now) {
+	uint32_t start_cycles = DWT->CYCCNT;
+	uint32_t bank;
+
+	for (;;) {
+		bank = __atomic_load_n(&list->active, __ATOMIC_SEQ_CST);
+		__atomic_fetch_add(&list->readers[bank], 1, __ATOMIC_SEQ_CST);
+
+		if (__atomic_load_n(&list->active, __ATOMIC_SEQ_CST) == bank) {
+			break;
+		}
+
+		__atomic_fetch_sub(&list->readers[bank], 1, __ATOMIC_SEQ_CST);
+	}
+
+	uint32_t pause = DWT->CYCCNT - start_cycles;
+	if (pause > list->max_pause_cycles) {
+		list->max_pause_cycles = pause;
+	}
+
+	uint8_t granted = Access_Grant(&list->banks[bank], uid, uid_size, groups, now);
+
+	__atomic_fetch_sub(&list->readers[bank], 1, __ATOMIC_SEQ_CST);
+
+	return granted;
+}
+
+/*
+ * Returns 1 if the badge may open a door of groups at time now. Blocked
+ * badges and badges outside their validity window are refused. Pass now = 0
+ * without a clock, the validity window is not checked then.
+ */
+uint8_t Access_Grant(Access_Table_t *table, const uint8_t *uid, uint8_t uid_size, uint32_t groups,
+        uint32_t now) {
+	if (table->damaged) {
+		return 0;
+	}
+
+	const Access_Record_t *record = Access_Lookup(table, uid, uid_size);
+
+	if (record == NULL || (record->flags & ACCESS_FLAG_BLOCKED) || !(record->groups & groups)) {
+		return 0;
+	}
+
+	if (now && ((record->valid_from && now < record->valid_from)
+	        || (record->valid_until && now > record->valid_until))) {
+		return 0;
+	}
+
+	return 1;
+}
+
+/*
+ * Reads the whole probe window of a UID and returns the slot holding it, or
+ * -1. There is no early exit and the comparison does not branch on the data.
+ */
+int32_t Access_Find(Access_Table_t *table, const uint8_t *uid, uint8_t uid_size) {
+	Access_Record_t key;
+	uint32_t found = 0;
+	uint32_t index = 0;
+	uint32_t start_cycles = DWT->CYCCNT;
+
+	if (uid_size == 0 || uid_size > ACCESS_UID_MAX_LEN) {
+		return -1;
+	}
+
+	Access_Key(&key, uid, uid_size);
+	uint32_t start = Access_Hash(uid, uid_size);
+
+	for (uint32_t i = 0; i < ACCESS_MAX_PROBES; i++) {
+		uint32_t slot = (start + i) & table->mask;
+		uint32_t match = Access_Matches(&table->slots[slot], &key);
+
+		// A UID is stored once, so at most one slot matches
+		found |= match;
+		index |= slot & (0 - match);
+	}
+
+	table->last_cycles = DWT->CYCCNT - start_cycles;
+	if (table->last_cycles > table->max_cycles) {
+		table->max_cycles = table->last_cycles;
+	}
+
+	return found ? (int32_t) index : -1;
+}
+
+/* Starts the cycle counter that lookups are timed with */
+void Access_EnableCycles(void) {
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+	DWT->LAR = 0xC5ACCE55; // Unlock the DWT (Cortex-M7)
+	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+}
+
+/* Points table at a filter that already holds its badges */
+void Access_AttachFilter(Access_Table_t *table, uint32_t *filter, uint32_t bits) {
+	table->filter = filter;
+	table->filter_mask = bits - 1;
+	table->filter_cycles = 0;
+	table->filter_rejects = 0;
+	table->filter_misses = 0;
+	table->reported = 0;
+}
+
+/* Filter bits for count badges, about 10 each, as many as the list has room for at most */
+uint32_t Access_FilterSize(const Access_List_t *list, uint32_t count) {
+	uint32_t bits = 256;
+
+	while (bits < list->filter_bits && bits < count * 10) {
+		bits <<= 1;
+	}
+
+	return bits;
+}
+
+/*
+ * Continues crc over size bytes, a multiple of 4. Like the CRC unit, every
+ * little endian word is fed in from its most significant byte.
+ */
+uint32_t Access_CRC32(uint32_t crc, const void *data, uint32_t size) {
+	const uint8_t *bytes = data;
+
+	for (uint32_t i = 0; i < size; i += 4) {
+		for (int8_t byte = 3; byte >= 0; byte--) {
+			crc = (crc << 8) ^ Access_CRC_Table[(crc >> 24) ^ bytes[i + byte]];
+		}
+	}
+
+	return crc;
+}
+
+/*
+ * Bit positions of a UID in the filter, by double hashing of a second hash.
+ * The table index comes from the low bits of the FNV-1a hash, and mixing it
+ * keeps UIDs that share a probe window from also sharing filter bits.
+ */
+void Access_FilterBits(Access_Table_t *table, const uint8_t *uid, uint8_t uid_size, uint32_t *bits) {
+	uint32_t a = Access_Hash(uid, uid_size);
+
+	// Finalizer of MurmurHash3
+	a = (a ^ (a >> 16)) * 0x85EBCA6B;
+	a = (a ^ (a >> 13)) * 0xC2B2AE35;
+	a ^= a >> 16;
+
+	uint32_t b = ((a >> 17) | (a << 15)) | 1;
+
+	for (uint8_t i = 0; i < ACCESS_FILTER_HASHES; i++) {
+		bits[i] = (a + i * b) & table->filter_mask;
+	}
+}
+
+/* Returns 1 if the UID may be in the table, 0 if it certainly is not */
+uint8_t Access_FilterCheck(Access_Table_t *table, const uint8_t *uid, uint8_t uid_size) {
+	uint32_t bits[ACCESS_FILTER_HASHES];
+	uint32_t hit = 1;
+	uint32_t start_cycles = DWT->CYCCNT;
+
+	Access_FilterBits(table, uid, uid_size, bits);
+
+	for (uint8_t i = 0; i < ACCESS_FILTER_HASHES; i++) {
+		hit &= table->filter[bits[i] >> 5] >> (bits[i] & 31);
+	}
+
+	table->filter_cycles = DWT->CYCCNT - start_cycles;
+
+	return hit & 1;
+}
+
+void Access_FilterAdd(Access_Table_t *table, const uint8_t *uid, uint8_t uid_size) {
+	uint32_t bits[ACCESS_FILTER_HASHES];
+
+	Access_FilterBits(table, uid, uid_size, bits);
+
+	for (uint8_t i = 0; i < ACCESS_FILTER_HASHES; i++) {
+		table->filter[bits[i] >> 5] |= 1u << (bits[i] & 31);
+	}
+}
+
+/* Returns the inactive bank once no lookup reads it anymore */
+uint32_t Access_StageBank(Access_List_t *list) {
+	uint32_t bank = !list->active;
+
+	while (__atomic_load_n(&list->readers[bank], __ATOMIC_SEQ_CST)) {
+		osDelay(1);
+	}
+
+	return bank;
+}
+
+/*
+ * Stages a new list holding only the changes of a batch from version 0 and
+ * commits it. The inactive bank is replaced whatever it held.
+ */
+Access_Status_t Access_RebuildBatch(Access_List_t *list, const Access_BatchHeader_t *header,
+        const uint8_t *changes) {
+	Access_Table_t *table = Access_Stage(list, header->to_version);
+
+	if (table == NULL) {
+		return ACCESS_ERR;
+	}
+
+	// Neither bank can catch up from this batch, the next one copies the list
+	memset(&list->last, 0, sizeof(list->last));
+	memcpy(list->last_changes, changes, header->count * sizeof(Access_Delta_t));
+
+	Access_Status_t status = Access_ApplyChanges(table, list->last_changes, header->count);
+
+	if (status == ACCESS_OK) {
+		status = Access_Commit(list);
+	}
+
+	if (status != ACCESS_OK) {
+		table->version = 0;
+	}
+
+	return status;
+}
+
+/* Applies the changes of a delta batch to a table, stops at the first that fails */
+Access_Status_t Access_ApplyChanges(Access_Table_t *table, const Access_Delta_t *changes, uint8_t count) {
+	Access_Record_t record;
+	Access_Status_t status;
+
+	for (uint8_t i = 0; i < count; i++) {
+		const Access_Delta_t *change = &changes[i];
+
+		if (change->uid_size == 0 || change->uid_size > ACCESS_UID_MAX_LEN) {
+			return ACCESS_ERR;
+		}
+
+		memset(&record, 0, sizeof(record));
+		record.uid_size = change->uid_size;
+		memcpy(record.uid, change->uid, change->uid_size);
+		record.flags = change->flags & ACCESS_FLAG_BLOCKED;
+		record.groups = change->groups;
+		record.valid_from = change->valid_from;
+		record.valid_until = change->valid_until;
+
+		switch (change->op) {
+		case ACCESS_DELTA_ADD:
+			status = Access_Insert(table, &record);
+			break;
+		case ACCESS_DELTA_REVOKE:
+			status = Access_Remove(table, record.uid, record.uid_size);
+			if (status == ACCESS_NOTFOUND) {
+				status = ACCESS_OK;
+			}
+			break;
+		case ACCESS_DELTA_MODIFY:
+			status = ACCESS_NOTFOUND;
+			if (Access_Find(table, record.uid, record.uid_size) >= 0) {
+				status = Access_Insert(table, &record);
+			}
+			break;
+		default:
+			status = ACCESS_ERR;
+			break;
+		}
+
+		if (status != ACCESS_OK) {
+			return status;
+		}
+	}
+
+	return ACCESS_OK;
+}
+
+/* Rebuilds the badges of from in an empty table on store, keeping its version */
+Access_Status_t Access_CopyTable(Access_Table_t *to, Access_Record_t *store, uint32_t capacity,
+        const Access_Table_t *from) {
+	if (Access_Init(to, store, capacity) != ACCESS_OK) {
+		return ACCESS_ERR;
+	}
+
+	for (uint32_t i = 0; i <= from->mask; i++) {
+		if ((from->slots[i].flags & ACCESS_FLAG_USED) && Access_Insert(to, &from->slots[i]) != ACCESS_OK) {
+			return ACCESS_FULL;
+		}
+	}
+
+	to->version = from->version;
+
+	return ACCESS_OK;
+}
+
+/* FNV-1a of the UID */
+uint32_t Access_Hash(const uint8_t *uid, uint8_t uid_size) {
+	uint32_t hash = 2166136261u;
+
+	for (uint8_t i = 0; i < uid_size; i++) {
+		hash = (hash ^ uid[i]) * 16777619u;
+	}
+
+	return hash;
+}
+
+/* Fills in the UID of a record the way it is stored, zero padded */
+void Access_Key(Access_Record_t *key, const uint8_t *uid, uint8_t uid_size) {
+	key->uid_size = uid_size;
+	memset(key->uid, 0, ACCESS_UID_MAX_LEN);
+	memcpy(key->uid, uid, uid_size);
+}
+
+/* Returns 1 if slot holds the UID of key, without branching on the bytes */
+uint32_t Access_Matches(const Access_Record_t *slot, const Access_Record_t *key) {
+	uint32_t diff = slot->uid_size ^ key->uid_size;
+
+	for (uint8_t i = 0; i < ACCESS_UID_MAX_LEN; i++) {
+		diff |= slot->uid[i] ^ key->uid[i];
+	}
+
+	diff |= (slot->flags & ACCESS_FLAG_USED) ^ ACCESS_FLAG_USED;
+
+	// diff is below 256, so diff - 1 only underflows when it is 0
+	return (diff - 1) >> 31;
+}
@@ -1,11 +1,17 @@
 #include "main.h"
 #include "cmsis_os.h"
 #include "mfrc522.h"
+#include "access.h"
+#include "sync.h"
 #include <stdio.h>
 
 osThreadId_t mfrc522TaskHandle;
 const osThreadAttr_t mfrc522Task_attributes = { .name = "mfrc522Task", .stack_size =
-        128 * 4, .priority = (osPriority_t) osPriorityNormal, };
+        256 * 4, .priority = (osPriority_t) osPriorityNormal, };
+
+osThreadId_t syncTaskHandle;
+const osThreadAttr_t syncTask_attributes = { .name = "syncTask", .stack_size = 512 * 4,
+        .priority = (osPriority_t) osPriorityBelowNormal, };
 
 osThreadId_t servoTaskHandle;
 const osThreadAttr_t servoTask_attributes = { .name = "servoTask", .stack_size = 128
@@ -14,26 +20,54 @@ const osThreadAttr_t servoTask_attributes = { .name = "servoTask", .stack_size =
 UART_HandleTypeDef UART_InitStruct;
 GPIO_InitTypeDef GPIO_InitStruct;
 SPI_HandleTypeDef SPI_InitStruct;
+DMA_HandleTypeDef SPI_DMATxStruct;
+DMA_HandleTypeDef SPI_DMARxStruct;
 TIM_HandleTypeDef TIM_InitStruct = { 0 };
 
-uint8_t AllowedCardID[4] = { 0x4D, 0xAF, 0x84, 0x59 };
+/* Readers on SPI2, add a handle with its own CS (and IRQ) pin for every extra reader */
+MFRC522_Bus_t MFRC522_Bus;
+MFRC522_Handle_t MFRC522_Reader = { .bus = &MFRC522_Bus, .cs_port = MFRC522_PORT_CS, .cs_pin =
+        MFRC522_PIN_CS, .irq_port = MFRC522_PORT_IRQ, .irq_pin = MFRC522_PIN_IRQ };
+MFRC522_Handle_t *Readers[] = { &MFRC522_Reader };
+
+/* Badges allowed through this door, two banks of the access list after the LCD frame buffer in SDRAM */
+#define DOOR_GROUP         0x01
+#define ACCESS_BANK_ADDR   0xC0800000
+#define ACCESS_BANK_SLOTS  (4 * 1024 * 1024 / sizeof(Access_Record_t))
+#define ACCESS_FILTER_BITS (1 << 19) // 64 KB per bank, both fill DTCM, about 13 bits per badge for 40000
+uint32_t AccessFilters[2][ACCESS_FILTER_BITS / 32] __attribute__((section(".dtcm")));
+Access_List_t AccessList = { .stores = { (Access_Record_t*) ACCESS_BANK_ADDR, (Access_Record_t*)
+        ACCESS_BANK_ADDR + ACCESS_BANK_SLOTS }, .filters = { AccessFilters[0], AccessFilters[1] }, .capacity =
+        ACCESS_BANK_SLOTS, .filter_bits = ACCESS_FILTER_BITS };
+const Access_Record_t AllowedCard = { .uid_size = 4, .uid = { 0x4D, 0xAF, 0x84, 0x59 }, .groups =
+        0xFFFFFFFF };
 uint8_t allowed = 0; // For communication with the servo motor
 
 void SystemClock_Config(void);
+void MPU_Config(void);
 void StartMFRC522Task(void *argument);
 void StartServoTask(void *argument);
+void StartSyncTask(void *argument);
 void LCD_Init(void);
 void UART_Init(void);
 void SPI_Init(void);
 void Servo_Init(void);
 
-/* Redirect printf and similar functions to UART */
+/* Redirect printf and similar functions to UART, shared with the sync task once the scheduler runs */
 int _write(int fd, char *ptr, int len) {
-	HAL_UART_Transmit(&UART_InitStruct, (uint8_t*) ptr, len, HAL_MAX_DELAY);
+	if (xTaskGetSchedulerState() == taskSCHEDULER_NOT_STARTED) {
+		HAL_UART_Transmit(&UART_InitStruct, (uint8_t*) ptr, len, HAL_MAX_DELAY);
+	} else {
+		Sync_Write((uint8_t*) ptr, len);
+	}
+
 	return len;
 }
 
 int main(void) {
+	/* Configure the MPU for the QSPI flash */
+	MPU_Config();
+
 	/* Enable I-Cache */
 	SCB_EnableICache();
 
@@ -56,14 +90,32 @@ int main(void) {
 
 	LCD_Init();
 	SPI_Init();
-	MFRC522_Init();
+	MFRC522_InitBus(&MFRC522_Bus, &SPI_InitStruct);
+	MFRC522_Init(&MFRC522_Reader);
+	printf("MFRC522 SPI clock: %lu kHz\r\n", MFRC522_CalibrateSPI(Readers, 1) / 1000);
 	Servo_Init();
 
+	/* Use the access list image in QSPI flash, or only the default card without one */
+	if (Access_ListInit(&AccessList) == ACCESS_OK) {
+		printf("Access list v%lu: %lu badges\r\n", AccessList.banks[0].version, AccessList.banks[0].count);
+	} else {
+		Access_Table_t *staged = Access_Stage(&AccessList, 1);
+
+		if (staged == NULL || Access_Insert(staged, &AllowedCard) != ACCESS_OK
+		        || Access_Commit(&AccessList) != ACCESS_OK) {
+			printf("[ERROR]: (main) Failed to set up the access list\r\n");
+		}
+	}
+
+	/* Access list updates arrive as delta batches on the debug UART */
+	Sync_Init(&UART_InitStruct, USART1_IRQn);
+
 	/* Init scheduler */
 	osKernelInitialize();
 
 	mfrc522TaskHandle = osThreadNew(StartMFRC522Task, NULL, &mfrc522Task_attributes);
 	servoTaskHandle = osThreadNew(StartServoTask, NULL, &servoTask_attributes);
+	syncTaskHandle = osThreadNew(StartSyncTask, NULL, &syncTask_attributes);
 
 	/* Start scheduler */
 	osKernelStart();
@@ -75,8 +127,8 @@ int main(void) {
 
 void StartMFRC522Task(void *argument) {
 	/* Recognized card ID */
-	uint8_t CardID[4];
-	uint8_t type;
+	MFRC522_UID_t CardID;
+	MFRC522_Presence_t Presence = { 0 };
 	char *result;
 	int status;
 	uint16_t line = 0;
@@ -86,9 +138,9 @@ void StartMFRC522Task(void *argument) {
 	printf("Started MFRC522 task\r\n");
 
 	for (;;) {
-		status = MFRC522_CheckCard(CardID, &type);
-		if (status == RFID_OK) {
-			MFRC522_PrettyPrint((unsigned char*) CardID, sizeof(CardID), &result);
+		status = MFRC522_PresenceCheck(&MFRC522_Reader, &Presence, &CardID);
+		if (status == RFID_OK && !Presence.held) {
+			MFRC522_PrettyPrint((unsigned char*) CardID.bytes, CardID.size, &result);
 			printf("Found tag: %s\r\n", result);
 
 			// Clear the display and start at line 1 again
@@ -101,11 +153,12 @@ void StartMFRC522Task(void *argument) {
 			BSP_LCD_DisplayStringAtLine(line, lcd_msg_1);
 			line++;
 
-			MFRC522_PrettyPrint((unsigned char*) &type, 1, &result);
+			MFRC522_PrettyPrint((unsigned char*) &CardID.sak, 1, &result);
 			printf("Type is: %s\r\n", result);
+			printf("SPI transactions saved: %lu\r\n", MFRC522_SavedTransactions(&MFRC522_Reader));
 
 			// Check if card is allowed
-			if (MFRC522_CompareIDs(CardID, AllowedCardID) == RFID_OK) {
+			if (Access_ListGrant(&AccessList, CardID.bytes, CardID.size, DOOR_GROUP, 0)) {
 				printf("Known ID, access is allowed\r\n");
 
 				snprintf(lcd_msg_2, sizeof(lcd_msg_2), "Access is allowed");
@@ -121,13 +174,14 @@ void StartMFRC522Task(void *argument) {
 				BSP_LCD_DisplayStringAtLine(line, lcd_msg_2);
 				line++;
 			}
-		} else {
-			if (status == RFID_ERR) {
-				printf("Error\r\n");
-			}
 		}
 
-		osDelay(1);
+		// Errors are only counted while reading, print them now that the card is done with
+		MFRC522_ReportErrors(&MFRC522_Reader);
+		Access_ReportFilter(&AccessList.banks[AccessList.active]);
+
+		// The reader sleeps in between, checks slow down while no card shows up
+		osDelay(Presence.interval_ms);
 	}
 }
 
@@ -150,6 +204,15 @@ void StartServoTask(void *argument) {
 	}
 }
 
+void StartSyncTask(void *argument) {
+	printf("Started sync task\r\n");
+
+	// Startup only checked the image's header, read the rest now
+	Access_Verify(&AccessList.banks[0]);
+
+	Sync_Run(&AccessList);
+}
+
 void LCD_Init(void) {
 	uint32_t ts_status = TS_OK;
 
@@ -232,6 +295,14 @@ void SPI_Init(void) {
 	GPIO_InitStruct1.Pull = GPIO_PULLUP;
 	HAL_GPIO_Init(SPIx_CS_GPIO_PORT, &GPIO_InitStruct1);
 
+	/* MFRC522 IRQ pin configuration; the reader drives it low on an interrupt */
+	MFRC522_IRQ_CLK_ENABLE();
+	GPIO_InitStruct1.Pin = MFRC522_PIN_IRQ;
+	GPIO_InitStruct1.Mode = GPIO_MODE_IT_FALLING;
+	GPIO_InitStruct1.Speed = GPIO_SPEED_FREQ_LOW;
+	GPIO_InitStruct1.Pull = GPIO_PULLUP;
+	HAL_GPIO_Init(MFRC522_PORT_IRQ, &GPIO_InitStruct1);
+
 	SPIx_FORCE_RESET();
 	SPIx_RELEASE_RESET();
 	SPIx_CLK_ENABLE();
@@ -255,6 +326,45 @@ void SPI_Init(void) {
 	} else {
 		printf("Finished SPI initialization\r\n");
 	}
+
+	/* SPI DMA streams, used by the MFRC522 driver once the scheduler runs */
+	SPIx_DMA_CLK_ENABLE();
+
+	SPI_DMATxStruct.Instance = SPIx_TX_DMA_STREAM;
+	SPI_DMATxStruct.Init.Channel = SPIx_TX_DMA_CHANNEL;
+	SPI_DMATxStruct.Init.Direction = DMA_MEMORY_TO_PERIPH;
+	SPI_DMATxStruct.Init.PeriphInc = DMA_PINC_DISABLE;
+	SPI_DMATxStruct.Init.MemInc = DMA_MINC_ENABLE;
+	SPI_DMATxStruct.Init.PeriphDataAlignment = DMA_PDATAALIGN_BYTE;
+	SPI_DMATxStruct.Init.MemDataAlignment = DMA_MDATAALIGN_BYTE;
+	SPI_DMATxStruct.Init.Mode = DMA_NORMAL;
+	SPI_DMATxStruct.Init.Priority = DMA_PRIORITY_LOW;
+	SPI_DMATxStruct.Init.FIFOMode = DMA_FIFOMODE_DISABLE;
+
+	SPI_DMARxStruct.Instance = SPIx_RX_DMA_STREAM;
+	SPI_DMARxStruct.Init = SPI_DMATxStruct.Init;
+	SPI_DMARxStruct.Init.Channel = SPIx_RX_DMA_CHANNEL;
+	SPI_DMARxStruct.Init.Direction = DMA_PERIPH_TO_MEMORY;
+	SPI_DMARxStruct.Init.Priority = DMA_PRIORITY_HIGH;
+
+	if (HAL_DMA_Init(&SPI_DMATxStruct) != HAL_OK
+	        || HAL_DMA_Init(&SPI_DMARxStruct) != HAL_OK) {
+		printf("Error initializing SPI DMA\r\n");
+		return;
+	}
+
+	__HAL_LINKDMA(&SPI_InitStruct, hdmatx, SPI_DMATxStruct);
+	__HAL_LINKDMA(&SPI_InitStruct, hdmarx, SPI_DMARxStruct);
+
+	/* Priorities must not be above configLIBRARY_MAX_SYSCALL_INTERRUPT_PRIORITY */
+	HAL_NVIC_SetPriority(SPIx_TX_DMA_IRQn, 6, 0);
+	HAL_NVIC_EnableIRQ(SPIx_TX_DMA_IRQn);
+	HAL_NVIC_SetPriority(SPIx_RX_DMA_IRQn, 6, 0);
+	HAL_NVIC_EnableIRQ(SPIx_RX_DMA_IRQn);
+	HAL_NVIC_SetPriority(SPIx_IRQn, 6, 0);
+	HAL_NVIC_EnableIRQ(SPIx_IRQn);
+	HAL_NVIC_SetPriority(MFRC522_IRQ_EXTI_IRQn, 6, 0);
+	HAL_NVIC_EnableIRQ(MFRC522_IRQ_EXTI_IRQn);
 }
 
 void Servo_Init(void) {
@@ -297,6 +407,48 @@ void Error_Handler(void) {
 	}
 }
 
+/*
+ * Reading the QSPI window while the flash is not memory mapped stalls the
+ * bus, and the core may read it speculatively. The whole 256 MB window is
+ * therefore off limits, except for the 64 MB of flash, which is cached write
+ * through so a lookup reads each record once. The access list banks in
+ * SDRAM are only used by the CPU, so they are cached write back. The LCD
+ * frame buffer before them stays uncached.
+ */
+void MPU_Config(void) {
+	MPU_Region_InitTypeDef MPU_InitStruct;
+
+	HAL_MPU_Disable();
+
+	MPU_InitStruct.Enable = MPU_REGION_ENABLE;
+	MPU_InitStruct.BaseAddress = ACCESS_QSPI_BASE;
+	MPU_InitStruct.Size = MPU_REGION_SIZE_256MB;
+	MPU_InitStruct.AccessPermission = MPU_REGION_NO_ACCESS;
+	MPU_InitStruct.IsBufferable = MPU_ACCESS_NOT_BUFFERABLE;
+	MPU_InitStruct.IsCacheable = MPU_ACCESS_NOT_CACHEABLE;
+	MPU_InitStruct.IsShareable = MPU_ACCESS_NOT_SHAREABLE;
+	MPU_InitStruct.Number = MPU_REGION_NUMBER0;
+	MPU_InitStruct.TypeExtField = MPU_TEX_LEVEL0;
+	MPU_InitStruct.SubRegionDisable = 0x00;
+	MPU_InitStruct.DisableExec = MPU_INSTRUCTION_ACCESS_DISABLE;
+	HAL_MPU_ConfigRegion(&MPU_InitStruct);
+
+	MPU_InitStruct.Size = MPU_REGION_SIZE_64MB;
+	MPU_InitStruct.AccessPermission = MPU_REGION_FULL_ACCESS;
+	MPU_InitStruct.IsCacheable = MPU_ACCESS_CACHEABLE;
+	MPU_InitStruct.Number = MPU_REGION_NUMBER1;
+	HAL_MPU_ConfigRegion(&MPU_InitStruct);
+
+	MPU_InitStruct.BaseAddress = ACCESS_BANK_ADDR;
+	MPU_InitStruct.Size = MPU_REGION_SIZE_8MB;
+	MPU_InitStruct.IsBufferable = MPU_ACCESS_BUFFERABLE;
+	MPU_InitStruct.DisableExec = MPU_INSTRUCTION_ACCESS_DISABLE;
+	MPU_InitStruct.Number = MPU_REGION_NUMBER2;
+	HAL_MPU_ConfigRegion(&MPU_InitStruct);
+
+	HAL_MPU_Enable(MPU_PRIVILEGED_DEFAULT);
+}
+
 void SystemClock_Config(void) {
 	RCC_ClkInitTypeDef RCC_ClkInitStruct;
 	RCC_OscInitTypeDef RCC_OscInitStruct;
@@ -14,7 +14,7 @@
  *  | SCK (SCLK) |     D13     |
  *  |    MOSI    |     D11     |
  *  |    MISO    |     D12     |
- *  |    IRQ     |      /      |
+ *  |    IRQ     |     D2      |
  *  |    GND     |     GND     |
  *  |    RST     |     3.3V    |
  *  |    3.3V    |     3.3V    |
@@ -23,376 +23,2535 @@
 
 /* Includes */
 #include <stdlib.h>
+#include <stddef.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "main.h"
 #include "mfrc522.h"
+#include "FreeRTOS.h"
+#include "task.h"
+#include "semphr.h"
 
 /* Type definitions */
-extern SPI_HandleTypeDef SPI_InitStruct;
+/*
+ * Write-through shadow of registers that only the host changes, so reads (and
+ * writes of an unchanged value) don't need an SPI transaction. Status, FIFO
+ * and command registers are updated by the reader and are always accessed live.
+ */
+#define MFRC522_SHADOW_BIT(reg) (1ULL << (reg))
+#define MFRC522_SHADOW_MASK ( \
+	MFRC522_SHADOW_BIT(MFRC522_COML_EN_REG) | MFRC522_SHADOW_BIT(MFRC522_DIVL_EN_REG) | \
+	MFRC522_SHADOW_BIT(MFRC522_WATER_LEVEL_REG) | MFRC522_SHADOW_BIT(MFRC522_BIT_FRAMING_REG) | \
+	MFRC522_SHADOW_BIT(MFRC522_MODE_REG) | MFRC522_SHADOW_BIT(MFRC522_TX_MODE_REG) | \
+	MFRC522_SHADOW_BIT(MFRC522_RX_MODE_REG) | MFRC522_SHADOW_BIT(MFRC522_TX_CONTROL_REG) | \
+	MFRC522_SHADOW_BIT(MFRC522_TX_ASK_REG) | MFRC522_SHADOW_BIT(MFRC522_TX_SEL_REG) | \
+	MFRC522_SHADOW_BIT(MFRC522_RX_SEL_REG) | MFRC522_SHADOW_BIT(MFRC522_RX_THRESHOLD_REG) | \
+	MFRC522_SHADOW_BIT(MFRC522_DEMOD_REG) | MFRC522_SHADOW_BIT(MFRC522_MF_TX_REG) | \
+	MFRC522_SHADOW_BIT(MFRC522_MF_RX_REG) | MFRC522_SHADOW_BIT(MFRC522_MOD_WIDTH_REG) | \
+	MFRC522_SHADOW_BIT(MFRC522_RFC_FG_REG) | MFRC522_SHADOW_BIT(MFRC522_GS_N_REG) | \
+	MFRC522_SHADOW_BIT(MFRC522_CW_GS_P_REG) | MFRC522_SHADOW_BIT(MFRC522_MOD_GS_P_REG) | \
+	MFRC522_SHADOW_BIT(MFRC522_T_MODE_REG) | MFRC522_SHADOW_BIT(MFRC522_T_PRESCALER_REG) | \
+	MFRC522_SHADOW_BIT(MFRC522_T_RELOAD_REG_H) | MFRC522_SHADOW_BIT(MFRC522_T_RELOAD_REG_L))
+
+/*
+ * CRC_A lookup table (polynomial x^16 + x^12 + x^5 + 1, reflected 0x8408),
+ * expanded by the preprocessor so it lands in flash without runtime setup
+ */
+#define MFRC522_CRC_A_BIT(c)   (((c) >> 1) ^ (((c) & 1) * 0x8408))
+#define MFRC522_CRC_A_ENTRY(n) MFRC522_CRC_A_BIT(MFRC522_CRC_A_BIT(MFRC522_CRC_A_BIT( \
+	MFRC522_CRC_A_BIT(MFRC522_CRC_A_BIT(MFRC522_CRC_A_BIT(MFRC522_CRC_A_BIT( \
+	MFRC522_CRC_A_BIT((uint16_t) (n)))))))))
+#define MFRC522_CRC_A_ROW4(n)  MFRC522_CRC_A_ENTRY(n), MFRC522_CRC_A_ENTRY(n + 1), \
+	MFRC522_CRC_A_ENTRY(n + 2), MFRC522_CRC_A_ENTRY(n + 3)
+#define MFRC522_CRC_A_ROW16(n) MFRC522_CRC_A_ROW4(n), MFRC522_CRC_A_ROW4(n + 4), \
+	MFRC522_CRC_A_ROW4(n + 8), MFRC522_CRC_A_ROW4(n + 12)
+#define MFRC522_CRC_A_ROW64(n) MFRC522_CRC_A_ROW16(n), MFRC522_CRC_A_ROW16(n + 16), \
+	MFRC522_CRC_A_ROW16(n + 32), MFRC522_CRC_A_ROW16(n + 48)
+
+const uint16_t MFRC522_CRC_A_Table[256] = { MFRC522_CRC_A_ROW64(0), MFRC522_CRC_A_ROW64(64),
+        MFRC522_CRC_A_ROW64(128), MFRC522_CRC_A_ROW64(192) };
+
+#if MFRC522_CRC_BACKEND == MFRC522_CRC_HARDWARE
+CRC_HandleTypeDef CRC_InitStruct;
+#endif
+
+/* Set when the CRC self test fails, the coprocessor is then used instead */
+uint8_t MFRC522_CRCFallback = 0;
+
+/* Frame sizes by FSCI/FSDI (ISO14443-4 section 5.2.3) */
+const uint16_t MFRC522_FrameSizes[9] = { 16, 24, 32, 40, 48, 64, 96, 128, 256 };
+
+/* SEL codes of the three cascade levels */
+const uint8_t MFRC522_Cascades[3] = { MFRC522_PICC_SEL_CL1, MFRC522_PICC_SEL_CL2,
+        MFRC522_PICC_SEL_CL3 };
+
+/* ModWidth and RxThreshold by MFRC522_SPEED_x, shorter pauses and a lower MinLevel for BPSK */
+const uint8_t MFRC522_ModWidths[4] = { 0x26, 0x15, 0x0A, 0x05 };
+const uint8_t MFRC522_RxThresholds[4] = { 0x84, 0x55, 0x55, 0x55 };
+
+/* Negotiated bit rates, the oldest record is reused for a new card */
+MFRC522_Rate_t MFRC522_Rates[MFRC522_RATE_RECORDS];
+uint8_t MFRC522_RateNext = 0;
+
+/* Tuning profiles of the registered readers as stored in flash */
+#define MFRC522_TUNING_MAGIC 0x54554E31 // "TUN1"
+typedef struct {
+	uint32_t magic;
+	MFRC522_Tuning_t profiles[MFRC522_MAX_READERS]; // by registry index
+	uint16_t crc; // CRC_A of the profiles
+} MFRC522_TuningStore_t;
+
+/* Settings before tuning: maximum gain, reset conductances and threshold */
+const MFRC522_Tuning_t MFRC522_DefaultTuning = { 0, 0x70, 0x20, 0x20, 0x88, 0x84 };
+
+/* Values MFRC522_Tune tries for each setting, one setting at a time */
+const uint8_t MFRC522_TuneFields[4] = { offsetof(MFRC522_Tuning_t, rf_cfg), offsetof(MFRC522_Tuning_t,
+        cw_gs_p), offsetof(MFRC522_Tuning_t, gs_n), offsetof(MFRC522_Tuning_t, rx_threshold) };
+const uint8_t MFRC522_TuneSteps[4][4] = {
+	{ 0x70, 0x60, 0x50, 0x40 }, // RxGain 48, 43, 38 and 33 dB
+	{ 0x3F, 0x30, 0x20, 0x10 }, // CWGsP
+	{ 0xF8, 0xC8, 0x88, 0x48 }, // CWGsN, ModGsN stays at 8
+	{ 0xA4, 0x84, 0x64, 0x44 }, // MinLevel, CollLevel stays at 4
+};
+
+/*
+ * IRQs of the commands that end on their own. Only the sources that end a
+ * command are routed to the IRQ pin, the others are polled.
+ */
+#define MFRC522_AUTHENT_IRQ_EN    (MFRC522_IRQ_IDLE | MFRC522_IRQ_ERR)
+#define MFRC522_AUTHENT_WAIT      MFRC522_IRQ_IDLE
+#define MFRC522_TRANSCEIVE_IRQ_EN (MFRC522_IRQ_TX | MFRC522_IRQ_RX | MFRC522_IRQ_IDLE | \
+	MFRC522_IRQ_LO_ALERT | MFRC522_IRQ_ERR | MFRC522_IRQ_TIMER)
+#define MFRC522_TRANSCEIVE_WAIT   (MFRC522_IRQ_RX | MFRC522_IRQ_IDLE)
+
+_Static_assert(!(MFRC522_AUTHENT_WAIT & ~MFRC522_AUTHENT_IRQ_EN),
+        "MFAuthent waits for an IRQ it does not enable");
+_Static_assert(!(MFRC522_TRANSCEIVE_WAIT & ~MFRC522_TRANSCEIVE_IRQ_EN),
+        "Transceive waits for an IRQ it does not enable");
+_Static_assert(!((MFRC522_AUTHENT_IRQ_EN | MFRC522_TRANSCEIVE_IRQ_EN) & ~MFRC522_IRQ_ALL),
+        "IRQ enable masks overlap IRqInv");
+_Static_assert(!((MFRC522_AUTHENT_WAIT | MFRC522_TRANSCEIVE_WAIT) & (MFRC522_IRQ_TIMER | MFRC522_IRQ_LO_ALERT
+        | MFRC522_IRQ_HI_ALERT)), "The timer and FIFO alerts have their own handling");
+
+typedef struct {
+	uint8_t irq_en; // ComIEnReg without the IRQ pin
+	uint8_t wait_irq; // IRQs that end the command
+} MFRC522_CommandIRQ_t;
+
+/* By command code, commands without an entry are not waited for */
+const MFRC522_CommandIRQ_t MFRC522_CommandIRQs[16] = {
+	[MFRC522_COMMAND_MF_AUTHENT] = { MFRC522_AUTHENT_IRQ_EN, MFRC522_AUTHENT_WAIT },
+	[MFRC522_COMMAND_TRANSCEIVE] = { MFRC522_TRANSCEIVE_IRQ_EN, MFRC522_TRANSCEIVE_WAIT },
+};
+
+/* Register settings of MFRC522_Init that do not depend on the reader, as register and value */
+const uint8_t MFRC522_InitSequence[][2] = {
+	{ MFRC522_TX_ASK_REG, MFRC522_TX_ASK_FORCE_100 },
+	{ MFRC522_MODE_REG, MFRC522_MODE_DEFAULT },
+	{ MFRC522_WATER_LEVEL_REG, MFRC522_WATER_LEVEL },
+};
+
+/* Configuration checks */
+_Static_assert(MFRC522_WATER_LEVEL > 0 && MFRC522_WATER_LEVEL < MFRC522_FIFO_SIZE,
+        "WaterLevel is 6 bits and has to leave room on both sides");
+_Static_assert(MFRC522_DMA_BUF_SIZE > MFRC522_FIFO_SIZE, "A full FIFO burst has to fit the DMA buffers");
+_Static_assert(MFRC522_TCL_FSDI <= 8 && MFRC522_TCL_FSD >= MFRC522_FIFO_SIZE, "FSDI above 8 is RFU");
+_Static_assert(MFRC522_TCL_MAX_SPEED <= MFRC522_SPEED_848, "The MFRC522 stops at 848 kbps");
+_Static_assert(MFRC522_MAX_READERS <= 127, "Registry indexes are int8_t");
+_Static_assert(MFRC522_MAX_LEN <= MFRC522_FIFO_SIZE, "Short answers are read in one FIFO burst");
+
+/* Status names for MFRC522_ReportErrors */
+const char *MFRC522_StatusNames[RFID_STATUS_COUNT] = { "ok", "no tag", "error", "timeout", "collision",
+        "busy", "CRC error", "parity error", "protocol error", "overflow", "temperature error",
+        "SPI error" };
+
+/* Initialized readers, so the EXTI and SPI callbacks can find their handle */
+MFRC522_Handle_t *MFRC522_Readers[MFRC522_MAX_READERS];
+uint8_t MFRC522_ReaderCount = 0;
+
+/* Private function definitions */
+MFRC522_Status_t MFRC522_Error(MFRC522_Handle_t *reader, MFRC522_Status_t status);
+void MFRC522_LoadTuning(MFRC522_Handle_t *reader, int8_t index);
+void MFRC522_ApplyTuning(MFRC522_Handle_t *reader);
+int32_t MFRC522_TuneScore(MFRC522_Handle_t *reader, MFRC522_UID_t *reference);
+uint16_t MFRC522_TuningCRC(const MFRC522_Tuning_t *profiles);
+MFRC522_Status_t MFRC522_DecodeError(uint8_t error_reg);
+void MFRC522_Reset(MFRC522_Handle_t *reader);
+void MFRC522_InitIRQ(MFRC522_Handle_t *reader);
+void MFRC522_ArmIRQ(MFRC522_Handle_t *reader);
+uint8_t MFRC522_WaitForIRQ(MFRC522_Handle_t *reader, uint8_t reg, uint8_t mask, uint32_t timeout_ms);
+void MFRC522_ChipSelect(MFRC522_Handle_t *reader);
+void MFRC522_ChipDeselect(MFRC522_Handle_t *reader);
+uint8_t MFRC522_BusLock(MFRC522_Bus_t *bus);
+void MFRC522_BusUnlock(MFRC522_Bus_t *bus);
+MFRC522_Status_t MFRC522_Transfer(MFRC522_Handle_t *reader, uint8_t *tx, uint8_t *rx, uint16_t len);
+HAL_StatusTypeDef MFRC522_TransferDMA(MFRC522_Handle_t *reader, uint8_t *tx, uint8_t *rx, uint16_t len);
+void MFRC522_TransferDoneFromISR(SPI_HandleTypeDef *hspi, HAL_StatusTypeDef result);
+void MFRC522_WriteRegister(MFRC522_Handle_t *reader, uint8_t reg, uint8_t data);
+uint8_t MFRC522_ReadRegister(MFRC522_Handle_t *reader, uint8_t reg);
+void MFRC522_WriteFIFO(MFRC522_Handle_t *reader, uint8_t *data, uint8_t len);
+void MFRC522_ReadFIFO(MFRC522_Handle_t *reader, uint8_t *data, uint8_t len);
+void MFRC522_EnableAntenna(MFRC522_Handle_t *reader);
+void MFRC522_DisableAntenna(MFRC522_Handle_t *reader);
+void MFRC522_Delay(uint32_t ms);
+void MFRC522_SetBitMask(MFRC522_Handle_t *reader, uint8_t reg, uint8_t mask);
+void MFRC522_ClearBitMask(MFRC522_Handle_t *reader, uint8_t reg, uint8_t mask);
+void MFRC522_StartRequest(MFRC522_Handle_t *reader, uint8_t request_mode);
+MFRC522_Status_t MFRC522_FinishRequest(MFRC522_Handle_t *reader, uint8_t *tag_type);
+void MFRC522_StartCommand(MFRC522_Handle_t *reader, uint8_t command, uint8_t *in_data, uint8_t in_len);
+void MFRC522_StartStream(MFRC522_Handle_t *reader, uint8_t command, uint8_t *in_data, uint16_t in_len,
+        uint8_t stream_rx);
+void MFRC522_StreamTX(MFRC522_Handle_t *reader, uint8_t *data, uint16_t len);
+MFRC522_Status_t MFRC522_FinishCommand(MFRC522_Handle_t *reader, uint8_t *out_data, uint16_t *out_len);
+MFRC522_Status_t MFRC522_FinishCommandBuffer(MFRC522_Handle_t *reader, uint8_t *out_data,
+        uint16_t out_size, uint16_t *out_len);
+uint8_t MFRC522_CommandDone(MFRC522_Handle_t *reader);
+uint8_t MFRC522_WaitCommand(MFRC522_Handle_t *reader);
+MFRC522_Status_t MFRC522_ToCard(MFRC522_Handle_t *reader, uint8_t command, uint8_t *in_data, uint8_t in_len,
+        uint8_t *out_data, uint16_t *out_len);
+MFRC522_Status_t MFRC522_CalculateCRC(MFRC522_Handle_t *reader, uint8_t *in_data, uint16_t len,
+        uint8_t *out_data);
+MFRC522_Status_t MFRC522_CalculateCRCReader(MFRC522_Handle_t *reader, uint8_t *in_data, uint16_t len,
+        uint8_t *out_data);
+void MFRC522_InitCRC(MFRC522_Handle_t *reader);
+MFRC522_Status_t MFRC522_SelfTest(MFRC522_Handle_t *reader, uint8_t *result);
+MFRC522_Status_t MFRC522_CheckSPI(MFRC522_Handle_t *reader, uint8_t version, uint8_t *signature);
+void MFRC522_SetPrescaler(MFRC522_Bus_t *bus, uint32_t prescaler);
+uint32_t MFRC522_BusClock(MFRC522_Bus_t *bus, uint32_t prescaler);
+void MFRC522_DetectStartPhase(MFRC522_Handle_t *reader, MFRC522_Detect_t *ctx);
+void MFRC522_DetectFinishPhase(MFRC522_Handle_t *reader, MFRC522_Detect_t *ctx);
+void MFRC522_DetectAnticollision(MFRC522_Handle_t *reader, MFRC522_Detect_t *ctx);
+void MFRC522_DetectSelect(MFRC522_Handle_t *reader, MFRC522_Detect_t *ctx);
+void MFRC522_DetectFail(MFRC522_Handle_t *reader, MFRC522_Detect_t *ctx, MFRC522_Status_t status);
+void MFRC522_DetectLoadLevel(MFRC522_Detect_t *ctx);
+MFRC522_Status_t MFRC522_RunDetect(MFRC522_Handle_t *reader, MFRC522_Detect_t *ctx);
+MFRC522_Status_t MFRC522_MifareTransceive(MFRC522_Handle_t *reader, uint8_t *data, uint8_t len,
+        uint8_t silence_ok);
+uint8_t MFRC522_SectorFirstBlock(uint8_t sector);
+uint8_t MFRC522_SectorBlocks(uint8_t sector);
+uint32_t MFRC522_FWT(uint8_t fwi);
+MFRC522_Status_t MFRC522_TransceiveFrame(MFRC522_Handle_t *reader, uint8_t *frame, uint16_t len,
+        uint8_t *rx, uint16_t rx_size, uint16_t *rx_len);
+MFRC522_Status_t MFRC522_ExchangeBlock(MFRC522_Handle_t *reader, MFRC522_TCL_t *tcl, uint16_t len,
+        uint16_t *rx_len);
+void MFRC522_SetSpeed(MFRC522_Handle_t *reader, uint8_t tx_speed, uint8_t rx_speed);
+MFRC522_Status_t MFRC522_ExchangeChained(MFRC522_Handle_t *reader, MFRC522_TCL_t *tcl,
+        const uint8_t *apdu, uint16_t len, uint8_t *resp, uint16_t resp_size, uint16_t *resp_len);
+MFRC522_Rate_t* MFRC522_RateRecord(MFRC522_UID_t *uid, uint8_t create);
+void MFRC522_RateFallback(MFRC522_UID_t *uid, uint8_t failed_speed);
+
+/* Initializes an SPI bus shared by one or more readers */
+void MFRC522_InitBus(MFRC522_Bus_t *bus, SPI_HandleTypeDef *spi) {
+	bus->spi = spi;
+	bus->dma_task = NULL;
+	bus->dma_result = HAL_OK;
+
+	// Static creation also works before the scheduler is started
+	bus->mutex = xSemaphoreCreateMutexStatic(&bus->mutex_buffer);
+}
+
+/*
+ * Initializes the reader. The bus must be initialized and the CS (and IRQ)
+ * pins configured by the caller, so every reader can sit on its own pins.
+ */
+void MFRC522_Init(MFRC522_Handle_t *reader) {
+	int8_t index = -1;
+
+	reader->shadow_valid = 0;
+	reader->shadow_saved = 0;
+
+	// Initializing a reader again (after calibration) keeps its registry entry
+	for (uint8_t i = 0; i < MFRC522_ReaderCount; i++) {
+		if (MFRC522_Readers[i] == reader) {
+			index = i;
+		}
+	}
+
+	if (index >= 0) {
+		// Already in the registry
+	} else if (MFRC522_ReaderCount < MFRC522_MAX_READERS) {
+		index = MFRC522_ReaderCount;
+		MFRC522_Readers[MFRC522_ReaderCount++] = reader;
+	} else {
+		printf("[ERROR]: (Init) Too many readers, IRQ pin and DMA are not available\r\n");
+		reader->irq_port = NULL;
+	}
+
+	MFRC522_ChipDeselect(reader);
+	MFRC522_Reset(reader);
+
+	// Readers are tuned by registry index, so they have to be initialized in the same order
+	MFRC522_LoadTuning(reader, index);
+	MFRC522_ApplyTuning(reader);
+
+	MFRC522_SetSpeed(reader, MFRC522_SPEED_106, MFRC522_SPEED_106);
+	MFRC522_SetTimeout(reader, MFRC522_TIMEOUT_DEFAULT);
+
+	// Every register takes its own transaction, the address byte holds for the whole burst
+	for (uint8_t i = 0; i < sizeof(MFRC522_InitSequence) / sizeof(MFRC522_InitSequence[0]); i++) {
+		MFRC522_WriteRegister(reader, MFRC522_InitSequence[i][0], MFRC522_InitSequence[i][1]);
+	}
+
+	MFRC522_InitIRQ(reader);
+	MFRC522_InitCRC(reader);
+	MFRC522_EnableAntenna(reader);
+}
+
+/*
+ * Tunes the receiver gain, driver conductances and receiver threshold of a
+ * reader. Hold the reference card (NULL accepts any card) where reads should
+ * still work, at the edge of the wanted range. Each setting is swept in turn,
+ * keeping the best value of the settings before it. A setting is scored by
+ * activating the card MFRC522_TUNE_ROUNDS times. The best profile is then
+ * stored in flash with MFRC522_SaveTuning. Returns RFID_NOTAGERR if the card
+ * was never read.
+ */
+MFRC522_Status_t MFRC522_Tune(MFRC522_Handle_t *reader, MFRC522_UID_t *reference) {
+	MFRC522_Tuning_t best = reader->tuning;
+	int32_t best_score = MFRC522_TuneScore(reader, reference);
+
+	for (uint8_t field = 0; field < 4; field++) {
+		for (uint8_t step = 0; step < 4; step++) {
+			MFRC522_Tuning_t candidate = best;
+			uint8_t *value = (uint8_t*) &candidate + MFRC522_TuneFields[field];
+
+			if (*value == MFRC522_TuneSteps[field][step]) {
+				continue; // Already scored
+			}
+
+			*value = MFRC522_TuneSteps[field][step];
+			reader->tuning = candidate;
+			MFRC522_ApplyTuning(reader);
+
+			int32_t score = MFRC522_TuneScore(reader, reference);
+			if (score > best_score) {
+				best = candidate;
+				best_score = score;
+			}
+		}
+	}
+
+	best.valid = 1;
+	reader->tuning = best;
+	MFRC522_ApplyTuning(reader);
+
+	if (best_score <= 0) {
+		return RFID_NOTAGERR;
+	}
+
+	return MFRC522_SaveTuning();
+}
+
+/*
+ * Activates the reference card MFRC522_TUNE_ROUNDS times with the current
+ * settings. Every activation scores 4 and every counted receive error costs 1,
+ * so settings that read reliably but with corrupted frames on the way still
+ * lose against clean ones.
+ */
+int32_t MFRC522_TuneScore(MFRC522_Handle_t *reader, MFRC522_UID_t *reference) {
+	static const MFRC522_Status_t counted[] = { RFID_CRC_ERR, RFID_PARITY_ERR, RFID_PROTOCOL_ERR,
+	        RFID_COLLISION, RFID_OVERFLOW };
+	MFRC522_UID_t uid;
+	int32_t score = 0;
+
+	for (uint8_t i = 0; i < sizeof(counted) / sizeof(counted[0]); i++) {
+		score += reader->stats.errors[counted[i]];
+	}
+
+	for (uint8_t round = 0; round < MFRC522_TUNE_ROUNDS; round++) {
+		// Cycling the field resets the card, it would not answer REQA after HALT
+		MFRC522_DisableAntenna(reader);
+		MFRC522_Delay(MFRC522_FIELD_SETTLE_MS);
+		MFRC522_EnableAntenna(reader);
+		MFRC522_Delay(MFRC522_FIELD_SETTLE_MS);
+
+		if (MFRC522_CheckCard(reader, &uid) == RFID_OK
+		        && (reference == NULL || MFRC522_CompareIDs(&uid, reference) == RFID_OK)) {
+			score += 4;
+		}
+	}
+
+	for (uint8_t i = 0; i < sizeof(counted) / sizeof(counted[0]); i++) {
+		score -= reader->stats.errors[counted[i]];
+	}
+
+	return score;
+}
+
+/*
+ * Writes the tuning profiles of all registered readers to flash. Erasing the
+ * sector stalls the CPU for a second or two, so only call it while setting up.
+ */
+MFRC522_Status_t MFRC522_SaveTuning(void) {
+	MFRC522_TuningStore_t store;
+	FLASH_EraseInitTypeDef erase;
+	uint32_t sector_error;
+	HAL_StatusTypeDef status;
+
+	memset(&store, 0, sizeof(store));
+	store.magic = MFRC522_TUNING_MAGIC;
+
+	for (uint8_t i = 0; i < MFRC522_ReaderCount; i++) {
+		store.profiles[i] = MFRC522_Readers[i]->tuning;
+	}
+
+	store.crc = MFRC522_TuningCRC(store.profiles);
+
+	erase.TypeErase = FLASH_TYPEERASE_SECTORS;
+	erase.Sector = MFRC522_TUNING_SECTOR;
+	erase.NbSectors = 1;
+	erase.VoltageRange = FLASH_VOLTAGE_RANGE_3;
+
+	HAL_FLASH_Unlock();
+	status = HAL_FLASHEx_Erase(&erase, &sector_error);
+
+	for (uint32_t i = 0; i < sizeof(store) && status == HAL_OK; i++) {
+		status = HAL_FLASH_Program(FLASH_TYPEPROGRAM_BYTE, MFRC522_TUNING_ADDR + i, ((uint8_t*) &store)[i]);
+	}
+
+	HAL_FLASH_Lock();
+
+	// The D-cache may still hold the erased sector
+	SCB_InvalidateDCache_by_Addr((uint32_t*) MFRC522_TUNING_ADDR, (sizeof(store) + 31) & ~31);
+
+	if (status != HAL_OK) {
+		printf("[ERROR]: (SaveTuning) Failed to write the tuning profiles to flash\r\n");
+		return RFID_ERR;
+	}
+
+	return RFID_OK;
+}
+
+/* Takes the reader's profile from flash, or the defaults if there is none */
+void MFRC522_LoadTuning(MFRC522_Handle_t *reader, int8_t index) {
+	const MFRC522_TuningStore_t *store = (const MFRC522_TuningStore_t*) MFRC522_TUNING_ADDR;
+
+	reader->tuning = MFRC522_DefaultTuning;
+
+	if (index < 0 || store->magic != MFRC522_TUNING_MAGIC || store->crc != MFRC522_TuningCRC(store->profiles)) {
+		return;
+	}
+
+	if (store->profiles[index].valid) {
+		reader->tuning = store->profiles[index];
+	}
+}
+
+/* Writes the tuning profile to the reader, RxThreshold is set along with the bit rate */
+void MFRC522_ApplyTuning(MFRC522_Handle_t *reader) {
+	MFRC522_WriteRegister(reader, MFRC522_RFC_FG_REG, reader->tuning.rf_cfg);
+	MFRC522_WriteRegister(reader, MFRC522_CW_GS_P_REG, reader->tuning.cw_gs_p);
+	MFRC522_WriteRegister(reader, MFRC522_MOD_GS_P_REG, reader->tuning.mod_gs_p);
+	MFRC522_WriteRegister(reader, MFRC522_GS_N_REG, reader->tuning.gs_n);
+	MFRC522_WriteRegister(reader, MFRC522_RX_THRESHOLD_REG, reader->tuning.rx_threshold);
+}
+
+uint16_t MFRC522_TuningCRC(const MFRC522_Tuning_t *profiles) {
+	const uint8_t *data = (const uint8_t*) profiles;
+	uint16_t crc = 0x6363;
+
+	for (uint16_t i = 0; i < sizeof(MFRC522_Tuning_t) * MFRC522_MAX_READERS; i++) {
+		crc = (crc >> 8) ^ MFRC522_CRC_A_Table[(crc ^ data[i]) & 0xFF];
+	}
+
+	return crc;
+}
+
+/*
+ * Finds the fastest SPI clock that all readers on a bus work at reliably.
+ * The bus starts at a known good prescaler. Each faster setting, up to
+ * MFRC522_SPI_MAX_HZ, must then pass the digital self test, VERSION readback
+ * and a FIFO pattern on every reader. If a setting fails, the last good one
+ * is also dropped, which leaves one step of margin. Call it before the
+ * scheduler starts. The readers are initialized again afterwards. Returns
+ * the chosen clock in Hz.
+ */
+uint32_t MFRC522_CalibrateSPI(MFRC522_Handle_t **readers, uint8_t count) {
+	uint8_t versions[MFRC522_MAX_READERS];
+	uint8_t signatures[MFRC522_MAX_READERS][MFRC522_FIFO_SIZE];
+	MFRC522_Bus_t *bus = readers[0]->bus;
+	uint32_t safe = bus->spi->Init.BaudRatePrescaler;
+	uint32_t prescaler = safe;
+	uint8_t ready = 1;
+	uint8_t failed = 0;
+
+	if (count > MFRC522_MAX_READERS) {
+		count = MFRC522_MAX_READERS;
+	}
+
+	// Reference results at the starting rate, so clones with other signatures work too
+	for (uint8_t i = 0; i < count; i++) {
+		versions[i] = MFRC522_ReadRegister(readers[i], MFRC522_VERSION_REG);
+
+		if (MFRC522_SelfTest(readers[i], signatures[i]) != RFID_OK) {
+			printf("[ERROR]: (CalibrateSPI) Self test failed, keeping the current clock\r\n");
+			ready = 0;
+			break;
+		}
+	}
+
+	// The BR field counts up in steps of SPI_CR1_BR_0, every step halves the clock
+	while (ready && prescaler > SPI_BAUDRATEPRESCALER_2) {
+		uint32_t faster = prescaler - SPI_CR1_BR_0;
+
+		if (MFRC522_BusClock(bus, faster) > MFRC522_SPI_MAX_HZ) {
+			break; // Limit of the reader, not of the wiring, so no margin is needed
+		}
+
+		MFRC522_SetPrescaler(bus, faster);
+
+		for (uint8_t i = 0; i < count && !failed; i++) {
+			failed = MFRC522_CheckSPI(readers[i], versions[i], signatures[i]) != RFID_OK;
+		}
+
+		if (failed) {
+			break;
+		}
+
+		prescaler = faster;
+	}
+
+	if (failed && prescaler != safe) {
+		prescaler += SPI_CR1_BR_0;
+	}
+
+	MFRC522_SetPrescaler(bus, prescaler);
+
+	// The self test leaves the readers reset
+	for (uint8_t i = 0; i < count; i++) {
+		MFRC522_Init(readers[i]);
+	}
+
+	return MFRC522_BusClock(bus, prescaler);
+}
+
+/* Returns the number of SPI transactions the register shadow has saved */
+uint32_t MFRC522_SavedTransactions(MFRC522_Handle_t *reader) {
+	return reader->shadow_saved;
+}
+
+/*
+ * Programs the reader's timer to end the next commands after us microseconds.
+ * TAuto starts the timer when transmission ends, so this is the frame waiting
+ * time and its TimerIRq ends the wait in ToCard.
+ */
+void MFRC522_SetTimeout(MFRC522_Handle_t *reader, uint32_t us) {
+	uint32_t cycles = ((uint64_t) us * 1356) / 100; // 13.56 MHz clock
+	uint32_t prescaler = 0xA9; // 25 us per tick, up to 1.6 s
+
+	// Longer timeouts need a slower tick so the reload value fits in 16 bits
+	if (cycles / (2 * prescaler + 1) > 0xFFFF) {
+		prescaler = (cycles / 0xFFFF) / 2 + 1;
+		if (prescaler > 0xFFF) {
+			prescaler = 0xFFF;
+		}
+	}
+
+	uint32_t reload = cycles / (2 * prescaler + 1);
+	if (reload == 0) {
+		reload = 1;
+	} else if (reload > 0xFFFF) {
+		reload = 0xFFFF;
+	}
+
+	// Unchanged values are skipped by the register shadow
+	MFRC522_WriteRegister(reader, MFRC522_T_MODE_REG, MFRC522_T_MODE_AUTO | (prescaler >> 8));
+	MFRC522_WriteRegister(reader, MFRC522_T_PRESCALER_REG, prescaler & 0xFF);
+	MFRC522_WriteRegister(reader, MFRC522_T_RELOAD_REG_H, reload >> 8);
+	MFRC522_WriteRegister(reader, MFRC522_T_RELOAD_REG_L, reload & 0xFF);
+
+	reader->timeout_ms = (us + 999) / 1000;
+}
+
+/* Sets the timeout from an ISO14443-4 frame waiting time integer, FWT = 302 us * 2^FWI */
+void MFRC522_SetFWI(MFRC522_Handle_t *reader, uint8_t fwi) {
+	MFRC522_SetTimeout(reader, MFRC522_FWT(fwi));
+}
+
+/* Returns the frame waiting time of a frame waiting time integer in microseconds */
+uint32_t MFRC522_FWT(uint8_t fwi) {
+	if (fwi > 14) {
+		fwi = 4; // RFU values mean the default (ISO14443-4 section 5.2.5)
+	}
+
+	// 256 * 16 / fc = 302.06 us
+	return ((uint32_t) 4096 * 1000 / 13560) << fwi;
+}
+
+/* Returns the reader's version number */
+uint8_t MFRC522_Version(MFRC522_Handle_t *reader) {
+	return MFRC522_ReadRegister(reader, MFRC522_VERSION_REG);
+}
+
+/* If card is found, its UID and SAK (type) are returned */
+MFRC522_Status_t MFRC522_CheckCard(MFRC522_Handle_t *reader, MFRC522_UID_t *uid) {
+	MFRC522_Detect_t ctx;
+
+	MFRC522_DetectStart(&ctx, uid);
+	return MFRC522_RunDetect(reader, &ctx);
+}
+
+/* Like MFRC522_CheckCard, but leaves the card selected for MIFARE commands */
+MFRC522_Status_t MFRC522_SelectCard(MFRC522_Handle_t *reader, MFRC522_UID_t *uid) {
+	MFRC522_Detect_t ctx;
+
+	// No session carries over to the card selected now
+	MFRC522_StopCrypto(reader);
+
+	MFRC522_DetectStart(&ctx, uid);
+	ctx.keep_selected = 1;
+	return MFRC522_RunDetect(reader, &ctx);
+}
+
+/*
+ * Checks that the card uid is still in the field with WUPA and a SELECT of
+ * the known UID, which skips anticollision, then halts it again. Returns
+ * RFID_TIMEOUT if no card answered and RFID_NOTAGERR if only other cards did.
+ */
+MFRC522_Status_t MFRC522_TrackCard(MFRC522_Handle_t *reader, MFRC522_UID_t *uid) {
+	MFRC522_Detect_t ctx;
+
+	MFRC522_DetectTrack(&ctx, uid);
+	return MFRC522_RunDetect(reader, &ctx);
+}
+
+/* Halts the selected card and stops Crypto1 */
+void MFRC522_HaltCard(MFRC522_Handle_t *reader) {
+	MFRC522_Detect_t ctx;
+	MFRC522_UID_t uid;
+
+	MFRC522_DetectStart(&ctx, &uid);
+	ctx.state = MFRC522_DETECT_HALT;
+	MFRC522_RunDetect(reader, &ctx);
+
+	// HALT is still sent encrypted after an authentication
+	MFRC522_StopCrypto(reader);
+}
+
+/* Steps ctx to the end, sleeping on the IRQ pin while a command is in flight */
+MFRC522_Status_t MFRC522_RunDetect(MFRC522_Handle_t *reader, MFRC522_Detect_t *ctx) {
+	MFRC522_Status_t status;
+
+	while ((status = MFRC522_DetectStep(reader, ctx)) == RFID_BUSY) {
+		MFRC522_WaitCommand(reader);
+	}
+
+	return status;
+}
+
+/* Prepares ctx to look for a card and store its UID in uid, DetectStep does the work */
+void MFRC522_DetectStart(MFRC522_Detect_t *ctx, MFRC522_UID_t *uid) {
+	memset(ctx, 0, sizeof(*ctx));
+	ctx->state = MFRC522_DETECT_REQUEST;
+	ctx->uid = uid;
+	uid->size = 0;
+}
+
+/* Like DetectStart, but only looks for the card uid (see MFRC522_TrackCard) */
+void MFRC522_DetectTrack(MFRC522_Detect_t *ctx, MFRC522_UID_t *uid) {
+	memset(ctx, 0, sizeof(*ctx));
+	ctx->state = MFRC522_DETECT_REQUEST;
+	ctx->uid = uid;
+	ctx->track = 1;
+}
+
+/*
+ * Advances card detection by at most one command and never waits for the
+ * card. Returns RFID_BUSY while a command is in flight, and the result of
+ * request, anticollision and select once the card has been halted again.
+ */
+MFRC522_Status_t MFRC522_DetectStep(MFRC522_Handle_t *reader, MFRC522_Detect_t *ctx) {
+	if (ctx->pending) {
+		if (!MFRC522_CommandDone(reader)) {
+			return RFID_BUSY;
+		}
+
+		ctx->pending = 0;
+		MFRC522_DetectFinishPhase(reader, ctx);
+	}
+
+	if (ctx->state == MFRC522_DETECT_DONE) {
+		return ctx->status;
+	}
+
+	MFRC522_DetectStartPhase(reader, ctx);
+	ctx->pending = 1;
+
+	return RFID_BUSY;
+}
+
+/*
+ * Wakes the reader, looks for a card and puts the reader back to sleep.
+ * The card found is tracked with MFRC522_TrackCard on the next check, and
+ * presence->held tells whether it is still the same card. Only when another
+ * card answers is a full detection run.
+ * presence->interval_ms is then the delay until the next check. It stays at
+ * MFRC522_POLL_MIN_MS for MFRC522_POLL_HOLD_MS after anything answered, then
+ * doubles on every empty check up to MFRC522_POLL_MAX_MS.
+ */
+MFRC522_Status_t MFRC522_PresenceCheck(MFRC522_Handle_t *reader, MFRC522_Presence_t *presence,
+        MFRC522_UID_t *uid) {
+	MFRC522_Status_t status = RFID_NOTAGERR;
+
+	MFRC522_Wake(reader);
+
+	// A card found last time is halted, but WUPA and its UID bring it back in one exchange per level
+	presence->held = 0;
+	if (presence->tracking) {
+		status = MFRC522_TrackCard(reader, &presence->card);
+		presence->held = (status == RFID_OK);
+	}
+
+	// Nothing to track, or a different card answered WUPA
+	if (status == RFID_NOTAGERR) {
+		status = MFRC522_CheckCard(reader, &presence->card);
+	}
+
+	MFRC522_Sleep(reader);
+
+	presence->tracking = (status == RFID_OK);
+	if (status == RFID_OK) {
+		*uid = presence->card;
+	}
+
+	uint32_t now = HAL_GetTick();
+
+	if (status != RFID_TIMEOUT) {
+		presence->last_event = now;
+		presence->interval_ms = MFRC522_POLL_MIN_MS;
+	} else if (now - presence->last_event >= MFRC522_POLL_HOLD_MS) {
+		presence->interval_ms *= 2;
+	}
+
+	if (presence->interval_ms < MFRC522_POLL_MIN_MS) {
+		presence->interval_ms = MFRC522_POLL_MIN_MS;
+	} else if (presence->interval_ms > MFRC522_POLL_MAX_MS) {
+		presence->interval_ms = MFRC522_POLL_MAX_MS;
+	}
+
+	return status;
+}
+
+/*
+ * Finds every card in the field. Each card is resolved by anticollision,
+ * selected and halted, so it stops answering REQA and the next pass
+ * walks the anticollision tree down to another card.
+ */
+MFRC522_Status_t MFRC522_Inventory(MFRC522_Handle_t *reader, MFRC522_UID_t *uids, uint8_t max_uids,
+        uint8_t *count) {
+	uint8_t failures = 0;
+	MFRC522_Status_t status = RFID_OK;
+
+	*count = 0;
+
+	while (*count < max_uids && failures < MFRC522_INVENTORY_RETRIES) {
+		status = MFRC522_CheckCard(reader, &uids[*count]);
+		if (status == RFID_TIMEOUT) {
+			break; // Every card in the field is halted
+		}
+
+		if (status != RFID_OK) {
+			// Garbled frames are common while several cards answer, retry
+			failures++;
+			continue;
+		}
+
+		(*count)++;
+	}
+
+	if (*count > 0) {
+		return RFID_OK;
+	}
+
+	return status;
+}
+
+/*
+ * Polls several readers for a card. Every reader runs its own detection and
+ * they are stepped in turn, so one reader's SPI transfers happen while the
+ * others wait for their cards and N idle readers cost about one REQA
+ * timeout instead of N.
+ */
+void MFRC522_PollReaders(MFRC522_Handle_t **readers, uint8_t count, MFRC522_UID_t *uids,
+        MFRC522_Status_t *statuses) {
+	MFRC522_Detect_t ctx[MFRC522_MAX_READERS];
+	int8_t waiting;
+
+	if (count > MFRC522_MAX_READERS) {
+		count = MFRC522_MAX_READERS;
+	}
+
+	for (uint8_t i = 0; i < count; i++) {
+		MFRC522_DetectStart(&ctx[i], &uids[i]);
+		statuses[i] = RFID_BUSY;
+	}
+
+	do {
+		waiting = -1;
+
+		for (uint8_t i = 0; i < count; i++) {
+			if (statuses[i] == RFID_BUSY) {
+				statuses[i] = MFRC522_DetectStep(readers[i], &ctx[i]);
+			}
+
+			if (statuses[i] == RFID_BUSY && waiting < 0) {
+				waiting = i;
+			}
+		}
+
+		// Sleep until the first busy reader is done, the others are checked right after
+		if (waiting >= 0) {
+			MFRC522_WaitCommand(readers[waiting]);
+		}
+	} while (waiting >= 0);
+}
+
+/* Check if two RFID card IDs match */
+MFRC522_Status_t MFRC522_CompareIDs(MFRC522_UID_t *id1, MFRC522_UID_t *id2) {
+	if (id1->size != id2->size) {
+		return RFID_ERR;
+	}
+
+	for (uint8_t i = 0; i < id1->size; i++) {
+		if (id1->bytes[i] != id2->bytes[i]) {
+			return RFID_ERR;
+		}
+	}
+
+	return RFID_OK;
+}
+
+/* Exchange len bytes with the reader inside a single chip-select window */
+MFRC522_Status_t MFRC522_Transfer(MFRC522_Handle_t *reader, uint8_t *tx, uint8_t *rx, uint16_t len) {
+	HAL_StatusTypeDef status;
+	MFRC522_Bus_t *bus = reader->bus;
+
+	// DMA and the bus mutex need the scheduler, so MFRC522_Init() from main() still polls
+	uint8_t locked = MFRC522_BusLock(bus);
+
+	MFRC522_ChipSelect(reader);
+
+#if MFRC522_USE_DMA
+	if (locked && len <= MFRC522_DMA_BUF_SIZE) {
+		status = MFRC522_TransferDMA(reader, tx, rx, len);
+	} else
+#endif
+	if (rx) {
+		status = HAL_SPI_TransmitReceive(bus->spi, tx, rx, len, HAL_MAX_DELAY);
+	} else {
+		status = HAL_SPI_Transmit(bus->spi, tx, len, HAL_MAX_DELAY);
+	}
+
+	MFRC522_ChipDeselect(reader);
+
+	if (locked) {
+		MFRC522_BusUnlock(bus);
+	}
+
+	return (status == HAL_OK) ? RFID_OK : RFID_ERR;
+}
+
+/*
+ * Takes the bus for a single transfer and returns 1, or returns 0 if there is
+ * no scheduler to arbitrate yet. The bus is never held while a reader waits
+ * for its card, so other readers can use it meanwhile.
+ */
+uint8_t MFRC522_BusLock(MFRC522_Bus_t *bus) {
+	if (xPortIsInsideInterrupt() || xTaskGetSchedulerState() != taskSCHEDULER_RUNNING) {
+		return 0;
+	}
+
+	xSemaphoreTake(bus->mutex, portMAX_DELAY);
+	return 1;
+}
+
+void MFRC522_BusUnlock(MFRC522_Bus_t *bus) {
+	xSemaphoreGive(bus->mutex);
+}
+
+#if MFRC522_USE_DMA
+/* Run a transfer on the SPI DMA streams and sleep until it completes, the bus must be locked */
+HAL_StatusTypeDef MFRC522_TransferDMA(MFRC522_Handle_t *reader, uint8_t *tx, uint8_t *rx, uint16_t len) {
+	MFRC522_Bus_t *bus = reader->bus;
+
+	memcpy(bus->dma_tx, tx, len);
+
+	// D-cache is enabled, so push TX data to SRAM and drop stale RX lines
+	SCB_CleanDCache_by_Addr((uint32_t*) bus->dma_tx, MFRC522_DMA_BUF_SIZE);
+	SCB_InvalidateDCache_by_Addr((uint32_t*) bus->dma_rx, MFRC522_DMA_BUF_SIZE);
+
+	// Drop any notification left over from an aborted transfer
+	ulTaskNotifyTake(pdTRUE, 0);
+	bus->dma_task = xTaskGetCurrentTaskHandle();
+
+	if (HAL_SPI_TransmitReceive_DMA(bus->spi, bus->dma_tx, bus->dma_rx, len) != HAL_OK) {
+		bus->dma_task = NULL;
+		return HAL_ERROR;
+	}
+
+	if (ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(MFRC522_DMA_TIMEOUT)) == 0) {
+		bus->dma_task = NULL;
+		HAL_SPI_Abort(bus->spi);
+		return HAL_TIMEOUT;
+	}
+
+	bus->dma_task = NULL;
+
+	if (bus->dma_result != HAL_OK) {
+		return bus->dma_result;
+	}
+
+	if (rx) {
+		SCB_InvalidateDCache_by_Addr((uint32_t*) bus->dma_rx, MFRC522_DMA_BUF_SIZE);
+		memcpy(rx, bus->dma_rx, len);
+	}
+
+	return HAL_OK;
+}
+
+/* Wake up the task waiting for the DMA transfer (called from interrupt context) */
+void MFRC522_TransferDoneFromISR(SPI_HandleTypeDef *hspi, HAL_StatusTypeDef result) {
+	BaseType_t higher_priority_woken = pdFALSE;
+
+	for (uint8_t i = 0; i < MFRC522_ReaderCount; i++) {
+		MFRC522_Bus_t *bus = MFRC522_Readers[i]->bus;
+
+		if (bus->spi == hspi && bus->dma_task != NULL) {
+			bus->dma_result = result;
+			vTaskNotifyGiveFromISR(bus->dma_task, &higher_priority_woken);
+			break;
+		}
+	}
+
+	portYIELD_FROM_ISR(higher_priority_woken);
+}
+
+void HAL_SPI_TxRxCpltCallback(SPI_HandleTypeDef *hspi) {
+	MFRC522_TransferDoneFromISR(hspi, HAL_OK);
+}
+
+void HAL_SPI_ErrorCallback(SPI_HandleTypeDef *hspi) {
+	MFRC522_TransferDoneFromISR(hspi, HAL_ERROR);
+}
+#endif
+
+/* Write a byte to a register */
+void MFRC522_WriteRegister(MFRC522_Handle_t *reader, uint8_t reg, uint8_t data) {
+	uint8_t tx[2];
+
+	if (MFRC522_SHADOW_MASK & MFRC522_SHADOW_BIT(reg)) {
+		if ((reader->shadow_valid & MFRC522_SHADOW_BIT(reg)) && reader->shadow[reg] == data) {
+			reader->shadow_saved++;
+			return;
+		}
+
+		reader->shadow[reg] = data;
+		reader->shadow_valid |= MFRC522_SHADOW_BIT(reg);
+	}
+
+	tx[0] = (reg << 1) & 0x7E;
+	tx[1] = data;
+
+	if (MFRC522_Transfer(reader, tx, NULL, 2) != RFID_OK) {
+		MFRC522_Error(reader, RFID_BUS_ERR);
+	}
+}
+
+/* Read a byte from a register */
+uint8_t MFRC522_ReadRegister(MFRC522_Handle_t *reader, uint8_t reg) {
+	uint8_t tx[2];
+	uint8_t rx[2] = { 0 };
+
+	if (reader->shadow_valid & MFRC522_SHADOW_BIT(reg)) {
+		reader->shadow_saved++;
+		return reader->shadow[reg];
+	}
+
+	tx[0] = (reg << 1) | 0x80;
+	tx[1] = 0x00;
+
+	if (MFRC522_Transfer(reader, tx, rx, 2) != RFID_OK) {
+		MFRC522_Error(reader, RFID_BUS_ERR);
+		return rx[1];
+	}
+
+	if (MFRC522_SHADOW_MASK & MFRC522_SHADOW_BIT(reg)) {
+		reader->shadow[reg] = rx[1];
+		reader->shadow_valid |= MFRC522_SHADOW_BIT(reg);
+	}
+
+	return rx[1];
+}
+
+/* Write several bytes to the FIFO in a single SPI transaction */
+void MFRC522_WriteFIFO(MFRC522_Handle_t *reader, uint8_t *data, uint8_t len) {
+	uint8_t tx[MFRC522_FIFO_SIZE + 1];
+
+	if (!len) {
+		return;
+	}
+
+	if (len > MFRC522_FIFO_SIZE) {
+		len = MFRC522_FIFO_SIZE;
+	}
+
+	// All following bytes are written to the same address (section 8.1.2.2)
+	tx[0] = (MFRC522_FIFO_DATA_REG << 1) & 0x7E;
+	memcpy(&tx[1], data, len);
+
+	if (MFRC522_Transfer(reader, tx, NULL, len + 1) != RFID_OK) {
+		MFRC522_Error(reader, RFID_BUS_ERR);
+	}
+}
+
+/* Read several bytes from the FIFO in a single SPI transaction */
+void MFRC522_ReadFIFO(MFRC522_Handle_t *reader, uint8_t *data, uint8_t len) {
+	uint8_t tx[MFRC522_FIFO_SIZE + 1];
+	uint8_t rx[MFRC522_FIFO_SIZE + 1];
+
+	if (!len) {
+		return;
+	}
+
+	if (len > MFRC522_FIFO_SIZE) {
+		len = MFRC522_FIFO_SIZE;
+	}
+
+	// The address is repeated for every byte and terminated with 0x00 (section 8.1.2.1)
+	for (uint8_t i = 0; i < len; i++) {
+		tx[i] = (MFRC522_FIFO_DATA_REG << 1) | 0x80;
+	}
+	tx[len] = 0x00;
+
+	if (MFRC522_Transfer(reader, tx, rx, len + 1) != RFID_OK) {
+		MFRC522_Error(reader, RFID_BUS_ERR);
+	}
+
+	// The first received byte arrives while the first address is sent
+	memcpy(data, &rx[1], len);
+}
+
+/* Sets up the reader's IRQ pin, its EXTI line must already be configured (falling edge) */
+void MFRC522_InitIRQ(MFRC522_Handle_t *reader) {
+#if MFRC522_USE_IRQ
+	if (reader->irq_port == NULL) {
+		return;
+	}
+
+	reader->irq_semaphore = xSemaphoreCreateBinaryStatic(&reader->irq_semaphore_buffer);
+
+	// Drive the pin push-pull (IRqInv makes it active low), CRCIRq is only routed to it during CalcCRC
+	MFRC522_WriteRegister(reader, MFRC522_DIVL_EN_REG, MFRC522_DIVIEN_PUSH_PULL);
+#endif
+}
+
+/* Drops a stale IRQ event, call after clearing the IRQ bits and before starting a command */
+void MFRC522_ArmIRQ(MFRC522_Handle_t *reader) {
+#if MFRC522_USE_IRQ
+	if (reader->irq_port != NULL) {
+		xSemaphoreTake(reader->irq_semaphore, 0);
+	}
+#endif
+}
+
+/* Waits until one of the mask bits is set in reg and returns the last value read */
+uint8_t MFRC522_WaitForIRQ(MFRC522_Handle_t *reader, uint8_t reg, uint8_t mask, uint32_t timeout_ms) {
+	uint8_t n;
+
+#if MFRC522_USE_IRQ
+	if (reader->irq_port != NULL && xTaskGetSchedulerState() == taskSCHEDULER_RUNNING) {
+		TickType_t start = xTaskGetTickCount();
+		TickType_t timeout = pdMS_TO_TICKS(timeout_ms);
+		TickType_t elapsed;
+
+		for (;;) {
+			n = MFRC522_ReadRegister(reader, reg);
+			elapsed = xTaskGetTickCount() - start;
+
+			if ((n & mask) || elapsed >= timeout) {
+				return n;
+			}
+
+			xSemaphoreTake(reader->irq_semaphore, timeout - elapsed);
+		}
+	}
+#endif
+
+	// Polling fallback, used before the scheduler starts or without the IRQ pin
+	uint32_t start = HAL_GetTick();
+	do {
+		n = MFRC522_ReadRegister(reader, reg);
+	} while (!(n & mask) && (HAL_GetTick() - start) <= timeout_ms);
+
+	return n;
+}
+
+#if MFRC522_USE_IRQ
+void HAL_GPIO_EXTI_Callback(uint16_t GPIO_Pin) {
+	BaseType_t higher_priority_woken = pdFALSE;
+
+	// EXTI lines are shared by all ports, so a pin number identifies one reader
+	for (uint8_t i = 0; i < MFRC522_ReaderCount; i++) {
+		MFRC522_Handle_t *reader = MFRC522_Readers[i];
+
+		if (reader->irq_port != NULL && reader->irq_pin == GPIO_Pin
+		        && reader->irq_semaphore != NULL) {
+			xSemaphoreGiveFromISR(reader->irq_semaphore, &higher_priority_woken);
+		}
+	}
+
+	portYIELD_FROM_ISR(higher_priority_woken);
+}
+#endif
+
+/* Soft reset the reader */
+void MFRC522_Reset(MFRC522_Handle_t *reader) {
+	MFRC522_WriteRegister(reader, MFRC522_COMMAND_REG, MFRC522_COMMAND_SOFT_RESET);
+	reader->shadow_valid = 0; // All registers are back at their reset values
+	reader->auth_key = 0; // Crypto1 is off
+	HAL_Delay(50);
+}
+
+/* Enables writing to reader */
+void MFRC522_ChipSelect(MFRC522_Handle_t *reader) {
+	HAL_GPIO_WritePin(reader->cs_port, reader->cs_pin, 0);
+}
+
+/* Enables reading from reader */
+void MFRC522_ChipDeselect(MFRC522_Handle_t *reader) {
+	HAL_GPIO_WritePin(reader->cs_port, reader->cs_pin, 1);
+}
+
+void MFRC522_SetBitMask(MFRC522_Handle_t *reader, uint8_t reg, uint8_t mask) {
+	MFRC522_WriteRegister(reader, reg, MFRC522_ReadRegister(reader, reg) | mask);
+}
+
+void MFRC522_ClearBitMask(MFRC522_Handle_t *reader, uint8_t reg, uint8_t mask) {
+	MFRC522_WriteRegister(reader, reg, MFRC522_ReadRegister(reader, reg) & (~mask));
+}
+
+void MFRC522_EnableAntenna(MFRC522_Handle_t *reader) {
+	uint8_t status = MFRC522_ReadRegister(reader, MFRC522_TX_CONTROL_REG);
+	if (!(status & MFRC522_TX_CONTROL_RF_EN)) {
+		MFRC522_SetBitMask(reader, MFRC522_TX_CONTROL_REG, MFRC522_TX_CONTROL_RF_EN);
+	}
+}
+
+void MFRC522_DisableAntenna(MFRC522_Handle_t *reader) {
+	MFRC522_ClearBitMask(reader, MFRC522_TX_CONTROL_REG, MFRC522_TX_CONTROL_RF_EN);
+}
+
+/* Puts the reader to sleep between polls, as selected by MFRC522_POWER_MODE */
+void MFRC522_Sleep(MFRC522_Handle_t *reader) {
+#if MFRC522_POWER_MODE == MFRC522_POWER_SOFT_POWERDOWN
+	// Stops the oscillator and with it the field, registers are kept (section 8.6.2)
+	MFRC522_WriteRegister(reader, MFRC522_COMMAND_REG, MFRC522_COMMAND_IDLE | MFRC522_COMMAND_POWER_DOWN);
+#elif MFRC522_POWER_MODE == MFRC522_POWER_ANTENNA_OFF
+	MFRC522_DisableAntenna(reader);
+#endif
+}
+
+/* Wakes the reader from MFRC522_Sleep and gives cards in the field time to power up */
+void MFRC522_Wake(MFRC522_Handle_t *reader) {
+#if MFRC522_POWER_MODE == MFRC522_POWER_SOFT_POWERDOWN
+	MFRC522_WriteRegister(reader, MFRC522_COMMAND_REG, MFRC522_COMMAND_IDLE);
+
+	// PowerDown reads 1 until the oscillator is stable again
+	uint32_t start = HAL_GetTick();
+	while ((MFRC522_ReadRegister(reader, MFRC522_COMMAND_REG) & MFRC522_COMMAND_POWER_DOWN)
+	        && (HAL_GetTick() - start) <= MFRC522_IRQ_MARGIN)
+		;
+#elif MFRC522_POWER_MODE == MFRC522_POWER_ANTENNA_OFF
+	MFRC522_EnableAntenna(reader);
+#endif
+
+#if MFRC522_POWER_MODE != MFRC522_POWER_ALWAYS_ON
+	MFRC522_Delay(MFRC522_FIELD_SETTLE_MS);
+#endif
+}
+
+/* Sleeps the calling task, or busy waits before the scheduler starts */
+void MFRC522_Delay(uint32_t ms) {
+	if (xTaskGetSchedulerState() == taskSCHEDULER_RUNNING) {
+		vTaskDelay(pdMS_TO_TICKS(ms));
+	} else {
+		HAL_Delay(ms);
+	}
+}
+
+/* Sends REQA/WUPA without waiting for the answer */
+void MFRC522_StartRequest(MFRC522_Handle_t *reader, uint8_t request_mode) {
+	if (reader->auth_key) {
+		MFRC522_StopCrypto(reader); // Crypto1 would encrypt the request
+	}
+
+	// Every card starts at 106 kbps, whatever an earlier PPS chose
+	MFRC522_SetSpeed(reader, MFRC522_SPEED_106, MFRC522_SPEED_106);
+
+	MFRC522_SetTimeout(reader, MFRC522_TIMEOUT_REQA);
+	MFRC522_WriteRegister(reader, MFRC522_BIT_FRAMING_REG, 0x07);
+
+	MFRC522_StartCommand(reader, MFRC522_COMMAND_TRANSCEIVE, &request_mode, 1);
+}
+
+/* Collects the ATQA of a request started with StartRequest */
+MFRC522_Status_t MFRC522_FinishRequest(MFRC522_Handle_t *reader, uint8_t *tag_type) {
+	uint16_t data;
+
+	MFRC522_Status_t status = MFRC522_FinishCommand(reader, tag_type, &data);
+	if (status == RFID_COLLISION) {
+		// Several cards answered at once, anticollision will tell them apart
+		return RFID_OK;
+	}
+
+	if (status == RFID_OK && data != 0x10) {
+		status = MFRC522_Error(reader, RFID_PROTOCOL_ERR); // ATQA is 16 bits
+	}
+
+	return status;
+}
+
+MFRC522_Status_t MFRC522_ToCard(MFRC522_Handle_t *reader, uint8_t command, uint8_t *in_data, uint8_t in_len,
+        uint8_t *out_data, uint16_t *out_len) {
+	MFRC522_StartCommand(reader, command, in_data, in_len);
+	return MFRC522_FinishCommand(reader, out_data, out_len);
+}
+
+/* Starts a command on the reader, FinishCommand waits for it and reads the answer */
+void MFRC522_StartCommand(MFRC522_Handle_t *reader, uint8_t command, uint8_t *in_data, uint8_t in_len) {
+	MFRC522_StartStream(reader, command, in_data, in_len, 0);
+}
+
+/*
+ * Like StartCommand, for data longer than the FIFO. The rest is written on
+ * LoAlert while the frame goes out, so this returns once all of it is in the
+ * FIFO. With stream_rx, FinishCommandBuffer drains the FIFO on HiAlert and
+ * can receive answers longer than the FIFO as well.
+ */
+void MFRC522_StartStream(MFRC522_Handle_t *reader, uint8_t command, uint8_t *in_data, uint16_t in_len,
+        uint8_t stream_rx) {
+	uint8_t first = (in_len > MFRC522_FIFO_SIZE) ? MFRC522_FIFO_SIZE : in_len;
+	uint8_t irq_en = MFRC522_CommandIRQs[command & 0x0F].irq_en;
+	uint8_t wait_irq = MFRC522_CommandIRQs[command & 0x0F].wait_irq;
+
+#if MFRC522_USE_IRQ
+	// The pin is level based, so only route the sources that end the command to it
+	irq_en = wait_irq | MFRC522_IRQ_TIMER;
+#endif
+
+	// LoAlertIRq while the rest is written, HiAlertIRq while the answer is drained
+	if (in_len > first) {
+		irq_en |= MFRC522_IRQ_LO_ALERT;
+	}
+
+	if (stream_rx) {
+		irq_en |= MFRC522_IRQ_HI_ALERT;
+	}
+
+	MFRC522_WriteRegister(reader, MFRC522_COML_EN_REG, irq_en | MFRC522_IRQ_INV);
+	MFRC522_WriteRegister(reader, MFRC522_COMMAND_REG, MFRC522_COMMAND_IDLE); // Stop active commands
+	MFRC522_WriteRegister(reader, MFRC522_COLL_REG, 0x00); // Clear ValuesAfterColl, the rest is read-only
+	MFRC522_WriteRegister(reader, MFRC522_COML_RQ_REG, MFRC522_IRQ_ALL); // Clear interrupt request bits
+	MFRC522_WriteRegister(reader, MFRC522_FIFO_LEVEL_REG, MFRC522_FIFO_FLUSH); // Initialize FIFO
+	MFRC522_ArmIRQ(reader);
+
+	// Write data to FIFO
+	MFRC522_WriteFIFO(reader, in_data, first);
+
+	// Execute command
+	MFRC522_WriteRegister(reader, MFRC522_COMMAND_REG, command);
+	if (command == MFRC522_COMMAND_TRANSCEIVE) {
+		MFRC522_SetBitMask(reader, MFRC522_BIT_FRAMING_REG, MFRC522_BIT_FRAMING_START_SEND);
+	}
+
+	reader->command = command;
+	reader->wait_irq = wait_irq;
+	reader->stream_rx = stream_rx;
+
+	if (in_len > first) {
+		MFRC522_StreamTX(reader, &in_data[first], in_len - first);
+	}
+
+	// The reader's timer only starts once the last byte is sent
+	reader->command_start = HAL_GetTick();
+}
+
+/*
+ * Keeps the FIFO of a running command filled. LoAlert is raised once the
+ * FIFO is down to MFRC522_WATER_LEVEL bytes, which leaves that long to
+ * write the next chunk before the transmitter runs dry.
+ */
+void MFRC522_StreamTX(MFRC522_Handle_t *reader, uint8_t *data, uint16_t len) {
+	while (len) {
+		MFRC522_WriteRegister(reader, MFRC522_COML_RQ_REG, MFRC522_IRQ_LO_ALERT); // Clear LoAlertIRq
+
+		// LoAlertIRq only fires on the transition, so check the level first
+		if (!(MFRC522_ReadRegister(reader, MFRC522_STATUS1_REG) & MFRC522_STATUS1_LO_ALERT)) {
+			uint8_t n = MFRC522_WaitForIRQ(reader, MFRC522_COML_RQ_REG, MFRC522_IRQ_LO_ALERT,
+			        reader->timeout_ms + MFRC522_IRQ_MARGIN);
+
+			if (!(n & MFRC522_IRQ_LO_ALERT)) {
+				MFRC522_Error(reader, RFID_TIMEOUT); // The frame goes out short and gets no answer
+				break;
+			}
+		}
+
+		uint8_t space = MFRC522_FIFO_SIZE
+		        - (MFRC522_ReadRegister(reader, MFRC522_FIFO_LEVEL_REG) & MFRC522_FIFO_LEVEL_MASK);
+		uint8_t chunk = (len > space) ? space : len;
+
+		MFRC522_WriteFIFO(reader, data, chunk);
+		data += chunk;
+		len -= chunk;
+	}
+
+	// The FIFO runs empty at the end of the frame, keep that off the IRQ pin
+	MFRC522_ClearBitMask(reader, MFRC522_COML_EN_REG, MFRC522_IRQ_LO_ALERT);
+	MFRC522_WriteRegister(reader, MFRC522_COML_RQ_REG, MFRC522_IRQ_LO_ALERT);
+}
+
+/* Returns 1 once the command started by StartCommand has ended, without waiting */
+uint8_t MFRC522_CommandDone(MFRC522_Handle_t *reader) {
+	if (MFRC522_ReadRegister(reader, MFRC522_COML_RQ_REG) & (MFRC522_IRQ_TIMER | reader->wait_irq)) {
+		return 1;
+	}
+
+	// The reader's timer normally ends the command, this only catches a lost reader
+	return (HAL_GetTick() - reader->command_start) > reader->timeout_ms + MFRC522_IRQ_MARGIN;
+}
+
+/* Waits until the command started by StartCommand ends and returns ComIrqReg */
+uint8_t MFRC522_WaitCommand(MFRC522_Handle_t *reader) {
+	uint32_t elapsed = HAL_GetTick() - reader->command_start;
+	uint32_t timeout = reader->timeout_ms + MFRC522_IRQ_MARGIN;
+
+	// A streamed answer also wakes up on HiAlert to drain the FIFO
+	return MFRC522_WaitForIRQ(reader, MFRC522_COML_RQ_REG,
+	        MFRC522_IRQ_TIMER | reader->wait_irq | (reader->stream_rx ? MFRC522_IRQ_HI_ALERT : 0x00),
+	        (elapsed < timeout) ? timeout - elapsed : 0);
+}
+
+MFRC522_Status_t MFRC522_FinishCommand(MFRC522_Handle_t *reader, uint8_t *out_data, uint16_t *out_len) {
+	return MFRC522_FinishCommandBuffer(reader, out_data, MFRC522_MAX_LEN, out_len);
+}
+
+/* Like FinishCommand, for answers of up to out_size bytes */
+MFRC522_Status_t MFRC522_FinishCommandBuffer(MFRC522_Handle_t *reader, uint8_t *out_data,
+        uint16_t out_size, uint16_t *out_len) {
+	MFRC522_Status_t status = RFID_ERR;
+	uint8_t command = reader->command;
+	uint8_t wait_irq = reader->wait_irq;
+	uint16_t received = 0;
+	uint8_t last_bits;
+	uint8_t n;
+
+	// Wait to receive data (or for the timer to run out)
+	for (;;) {
+		n = MFRC522_WaitCommand(reader);
+
+		if (!reader->stream_rx || (n & (MFRC522_IRQ_TIMER | wait_irq)) || !(n & MFRC522_IRQ_HI_ALERT)) {
+			break;
+		}
+
+		// HiAlert, take what arrived so far to make room for the rest of the frame
+		uint8_t level = MFRC522_ReadRegister(reader, MFRC522_FIFO_LEVEL_REG) & MFRC522_FIFO_LEVEL_MASK;
+		if (level > out_size - received) {
+			// The card sends more than fits, stop instead of spinning on HiAlert until it is done
+			MFRC522_WriteRegister(reader, MFRC522_COMMAND_REG, MFRC522_COMMAND_IDLE);
+			MFRC522_WriteRegister(reader, MFRC522_FIFO_LEVEL_REG, MFRC522_FIFO_FLUSH);
+			MFRC522_ClearBitMask(reader, MFRC522_BIT_FRAMING_REG, MFRC522_BIT_FRAMING_START_SEND);
+			reader->stream_rx = 0;
+			return MFRC522_Error(reader, RFID_OVERFLOW);
+		}
+
+		MFRC522_ReadFIFO(reader, &out_data[received], level);
+		received += level;
+		MFRC522_WriteRegister(reader, MFRC522_COML_RQ_REG, MFRC522_IRQ_HI_ALERT); // Clear HiAlertIRq
+
+		// The frame is still arriving, which a long one at 106 kbps does for a while
+		reader->command_start = HAL_GetTick();
+	}
+
+	reader->stream_rx = 0;
+
+	MFRC522_ClearBitMask(reader, MFRC522_BIT_FRAMING_REG, MFRC522_BIT_FRAMING_START_SEND);
+
+	// Error
+	uint8_t error_reg_val = MFRC522_ReadRegister(reader, MFRC522_ERROR_REG);
+	status = MFRC522_DecodeError(error_reg_val);
+	if (status != RFID_OK) {
+		return MFRC522_Error(reader, status);
+	}
+
+	// Timeout
+	if (!(n & (MFRC522_IRQ_TIMER | wait_irq))) {
+		return MFRC522_Error(reader, RFID_TIMEOUT);
+	} else if ((n & MFRC522_IRQ_TIMER) && !(n & wait_irq)) {
+		return MFRC522_Error(reader, RFID_TIMEOUT);
+	}
+
+	status = RFID_OK;
+
+	if (command == MFRC522_COMMAND_TRANSCEIVE) {
+		n = MFRC522_ReadRegister(reader, MFRC522_FIFO_LEVEL_REG) & MFRC522_FIFO_LEVEL_MASK;
+		last_bits = MFRC522_ReadRegister(reader, MFRC522_CONTROL_REG) & MFRC522_CONTROL_RX_LAST_BITS;
+
+		if (!n && !received) {
+			n = 1;
+		}
+
+		// The tail of a streamed answer has to fit as well
+		if (received && n > out_size - received) {
+			MFRC522_WriteRegister(reader, MFRC522_FIFO_LEVEL_REG, MFRC522_FIFO_FLUSH);
+			return MFRC522_Error(reader, RFID_OVERFLOW);
+		}
+
+		if (last_bits) {
+			*out_len = (received + n - 1) * 8 + last_bits;
+		} else {
+			*out_len = (received + n) * 8;
+		}
+
+		if (n > out_size - received) {
+			n = out_size - received;
+		}
+
+		// Read the received data from FIFO (also after a collision, for anticollision)
+		MFRC522_ReadFIFO(reader, &out_data[received], n);
+	}
+
+	// Collision, CollPos 0 stands for bit 32
+	if (error_reg_val & MFRC522_ERR_COLL) {
+		uint8_t coll = MFRC522_ReadRegister(reader, MFRC522_COLL_REG);
+
+		if (coll & MFRC522_COLL_POS_NOT_VALID) {
+			reader->stats.collision_bit = 0;
+		} else {
+			reader->stats.collision_bit = (coll & MFRC522_COLL_POS_MASK) ? (coll & MFRC522_COLL_POS_MASK) : 32;
+		}
+
+		return MFRC522_Error(reader, RFID_COLLISION);
+	}
+
+	return status;
+}
+
+/* Maps ErrorReg to a status, collisions (CollErr) are left to the caller */
+MFRC522_Status_t MFRC522_DecodeError(uint8_t error_reg) {
+	if (error_reg & MFRC522_ERR_TEMP) {
+		return RFID_TEMP_ERR;
+	} else if (error_reg & MFRC522_ERR_BUFFER_OVFL) {
+		return RFID_OVERFLOW;
+	} else if (error_reg & MFRC522_ERR_PROTOCOL) {
+		return RFID_PROTOCOL_ERR;
+	} else if (error_reg & MFRC522_ERR_PARITY) {
+		return RFID_PARITY_ERR;
+	} else if (error_reg & MFRC522_ERR_CRC) {
+		return RFID_CRC_ERR; // Only with RxCRCEn, CRC_A is normally checked by the host
+	}
+
+	return RFID_OK;
+}
+
+/* Counts an error and passes it on, error paths only count so they never wait for the UART */
+MFRC522_Status_t MFRC522_Error(MFRC522_Handle_t *reader, MFRC522_Status_t status) {
+	if (status != RFID_OK && status < RFID_STATUS_COUNT) {
+		reader->stats.errors[status]++;
+	}
+
+	return status;
+}
+
+/*
+ * Prints the errors counted since the last report, at most once per
+ * MFRC522_DIAG_INTERVAL_MS. Call it from the application task, where
+ * blocking on the UART is fine. Timeouts are left out, an empty field
+ * produces one on every check.
+ */
+void MFRC522_ReportErrors(MFRC522_Handle_t *reader) {
+#if MFRC522_DIAGNOSTICS
+	MFRC522_Stats_t *stats = &reader->stats;
+
+	if (HAL_GetTick() - stats->last_report < MFRC522_DIAG_INTERVAL_MS) {
+		return;
+	}
+
+	stats->last_report = HAL_GetTick();
+
+	for (uint8_t i = RFID_ERR; i < RFID_STATUS_COUNT; i++) {
+		uint32_t count = stats->errors[i] - stats->reported[i];
+
+		if (i == RFID_TIMEOUT || !count) {
+			continue;
+		}
+
+		stats->reported[i] = stats->errors[i];
+
+		if (i == RFID_COLLISION) {
+			printf("[ERROR]: (MFRC522) %lu x %s, last at bit %u\r\n", count, MFRC522_StatusNames[i],
+			        stats->collision_bit);
+		} else {
+			printf("[ERROR]: (MFRC522) %lu x %s\r\n", count, MFRC522_StatusNames[i]);
+		}
+	}
+#endif
+}
+
+/* Starts the command of the current detection phase */
+void MFRC522_DetectStartPhase(MFRC522_Handle_t *reader, MFRC522_Detect_t *ctx) {
+	uint8_t halt[4] = { MFRC522_PICC_HALT, 0x00 };
+
+	switch (ctx->state) {
+	case MFRC522_DETECT_REQUEST:
+		// WUPA also wakes a halted card
+		MFRC522_StartRequest(reader, ctx->track ? MFRC522_PICC_REQ_ALL : MFRC522_PICC_REQ_IDL);
+		break;
+	case MFRC522_DETECT_ANTICOLLISION: {
+		uint8_t full_bytes = ctx->known_bits / 8;
+		uint8_t extra_bits = ctx->known_bits % 8;
+
+		ctx->buffer[1] = ((2 + full_bytes) << 4) | extra_bits; // NVB
+
+		// Send only the known bits and align the answer right after them
+		MFRC522_SetTimeout(reader, MFRC522_TIMEOUT_SELECT);
+		MFRC522_WriteRegister(reader, MFRC522_BIT_FRAMING_REG, (extra_bits << 4) | extra_bits);
+		MFRC522_StartCommand(reader, MFRC522_COMMAND_TRANSCEIVE, ctx->buffer,
+		        2 + full_bytes + (extra_bits ? 1 : 0));
+		break;
+	}
+	case MFRC522_DETECT_SELECT:
+		ctx->buffer[1] = 0x70; // NVB, all 40 bits
+
+		if (MFRC522_CalculateCRC(reader, ctx->buffer, 7, &ctx->buffer[7]) == RFID_OK) {
+			MFRC522_StartCommand(reader, MFRC522_COMMAND_TRANSCEIVE, ctx->buffer, 9);
+			break;
+		}
+
+		MFRC522_DetectFail(reader, ctx, MFRC522_Error(reader, RFID_ERR));
+		/* fall through */
+	case MFRC522_DETECT_HALT:
+	default:
+		MFRC522_SetTimeout(reader, MFRC522_TIMEOUT_HALT);
+		MFRC522_CalculateCRC(reader, halt, 2, &halt[2]);
+		MFRC522_StartCommand(reader, MFRC522_COMMAND_TRANSCEIVE, halt, 4);
+		break;
+	}
+}
+
+/* Collects the answer to the command of the current phase and picks the next phase */
+void MFRC522_DetectFinishPhase(MFRC522_Handle_t *reader, MFRC522_Detect_t *ctx) {
+	MFRC522_Status_t status;
+
+	switch (ctx->state) {
+	case MFRC522_DETECT_REQUEST:
+		status = MFRC522_FinishRequest(reader, ctx->response);
+		if (status == RFID_OK && ctx->track) {
+			MFRC522_DetectLoadLevel(ctx);
+			ctx->state = MFRC522_DETECT_SELECT;
+		} else if (status == RFID_OK) {
+			ctx->buffer[0] = MFRC522_Cascades[0];
+			ctx->state = MFRC522_DETECT_ANTICOLLISION;
+		} else if (status == RFID_TIMEOUT) {
+			ctx->status = status; // No card, nothing to halt
+			ctx->state = MFRC522_DETECT_DONE;
+		} else {
+			MFRC522_DetectFail(reader, ctx, status);
+		}
+		break;
+	case MFRC522_DETECT_ANTICOLLISION:
+		MFRC522_DetectAnticollision(reader, ctx);
+		break;
+	case MFRC522_DETECT_SELECT:
+		MFRC522_DetectSelect(reader, ctx);
+		break;
+	case MFRC522_DETECT_HALT:
+	default:
+		// HALT is acknowledged by silence, so the timeout is expected
+		MFRC522_FinishCommand(reader, ctx->response, &ctx->response_bits);
+		ctx->state = MFRC522_DETECT_DONE;
+		break;
+	}
+}
+
+/*
+ * Handles one anticollision round of a cascade level (ISO14443-3 section
+ * 6.5.3). On a collision the bits up to the collision are kept, the colliding
+ * bit is set to 1 and the round is repeated with those bits, until a single
+ * card answers. buffer[2..6] then holds the 4 UID bytes and BCC of this level.
+ */
+void MFRC522_DetectAnticollision(MFRC522_Handle_t *reader, MFRC522_Detect_t *ctx) {
+	uint8_t *buffer = ctx->buffer;
+	uint8_t extra_bits = ctx->known_bits % 8;
+	uint8_t index = 2 + ctx->known_bits / 8; // first byte that is (partly) received
+
+	MFRC522_Status_t status = MFRC522_FinishCommand(reader, ctx->response, &ctx->response_bits);
+	if (status != RFID_OK && status != RFID_COLLISION) {
+		MFRC522_DetectFail(reader, ctx, status);
+		return;
+	}
+
+	// Merge the answer with the bits we already know
+	uint8_t received = (ctx->response_bits + 7) / 8;
+	for (uint8_t i = 0; i < received && index + i < 7; i++) {
+		if (i == 0 && extra_bits) {
+			uint8_t known_mask = (1 << extra_bits) - 1;
+			buffer[index] = (buffer[index] & known_mask) | (ctx->response[0] & ~known_mask);
+		} else {
+			buffer[index + i] = ctx->response[i];
+		}
+	}
+
+	if (status == RFID_COLLISION) {
+		uint8_t position = reader->stats.collision_bit;
+		if (!position) { // Collision outside of the UID
+			MFRC522_DetectFail(reader, ctx, RFID_COLLISION);
+			return;
+		}
+
+		if (position <= ctx->known_bits) { // No progress, give up rather than loop
+			MFRC522_DetectFail(reader, ctx, RFID_ERR);
+			return;
+		}
+
+		// Take the branch of the cards that sent a 1 at the colliding bit
+		ctx->known_bits = position;
+		buffer[2 + (position - 1) / 8] |= 1 << ((position - 1) % 8);
+
+		if (ctx->known_bits < 32) {
+			return; // Another round on this level
+		}
+
+		// All UID bits are known now, BCC follows from them
+		buffer[6] = buffer[2] ^ buffer[3] ^ buffer[4] ^ buffer[5];
+	}
+
+	MFRC522_WriteRegister(reader, MFRC522_BIT_FRAMING_REG, 0x00);
+
+	// Check serial number against its BCC
+	if ((buffer[2] ^ buffer[3] ^ buffer[4] ^ buffer[5]) != buffer[6]) {
+		MFRC522_DetectFail(reader, ctx, RFID_ERR);
+		return;
+	}
+
+	ctx->state = MFRC522_DETECT_SELECT;
+}
+
+/* Handles the SAK of a cascade level and moves on to the next level or to HALT */
+void MFRC522_DetectSelect(MFRC522_Handle_t *reader, MFRC522_Detect_t *ctx) {
+	MFRC522_UID_t *uid = ctx->uid;
+	uint8_t *uid_cl = &ctx->buffer[2];
+
+	MFRC522_Status_t status = MFRC522_FinishCommand(reader, ctx->response, &ctx->response_bits);
+	if (status != RFID_OK) {
+		// Something answered WUPA, but not the tracked card
+		MFRC522_DetectFail(reader, ctx, ctx->track ? RFID_NOTAGERR : status);
+		return;
+	}
+
+	// SAK must be 24 bits (1 byte + CRC)
+	if (ctx->response_bits != 24) {
+		MFRC522_DetectFail(reader, ctx, MFRC522_Error(reader, RFID_PROTOCOL_ERR));
+		return;
+	}
+
+	uint8_t sak = ctx->response[0];
+
+	if (ctx->track) {
+		// The UID is known already
+	} else if (uid_cl[0] == MFRC522_PICC_CASCADE_TAG && (sak & 0x04)) {
+		// A cascade tag means the UID continues on the next level
+		memcpy(&uid->bytes[uid->size], &uid_cl[1], 3);
+		uid->size += 3;
+	} else {
+		memcpy(&uid->bytes[uid->size], uid_cl, 4);
+		uid->size += 4;
+	}
+
+	// Cascade bit cleared, UID complete
+	if (!(sak & 0x04)) {
+		uid->sak = sak;
+		ctx->status = RFID_OK;
+		ctx->state = ctx->keep_selected ? MFRC522_DETECT_DONE : MFRC522_DETECT_HALT;
+		return;
+	}
+
+	if (++ctx->level >= 3) {
+		MFRC522_DetectFail(reader, ctx, RFID_ERR);
+		return;
+	}
+
+	if (ctx->track) {
+		MFRC522_DetectLoadLevel(ctx);
+		return; // Select the next level right away
+	}
+
+	ctx->known_bits = 0;
+	ctx->buffer[0] = MFRC522_Cascades[ctx->level];
+	memset(&ctx->buffer[2], 0, 5);
+	ctx->state = MFRC522_DETECT_ANTICOLLISION;
+}
+
+/* Fills buffer with the current cascade level of a known UID, ready for SELECT */
+void MFRC522_DetectLoadLevel(MFRC522_Detect_t *ctx) {
+	MFRC522_UID_t *uid = ctx->uid;
+	uint8_t *uid_cl = &ctx->buffer[2];
+	uint8_t levels = (uid->size - 1) / 3; // 4, 7 and 10 byte UIDs take 1, 2 and 3 levels
+	uint8_t offset = ctx->level * 3;
+
+	ctx->buffer[0] = MFRC522_Cascades[ctx->level];
+
+	if (ctx->level + 1 < levels) {
+		uid_cl[0] = MFRC522_PICC_CASCADE_TAG;
+		memcpy(&uid_cl[1], &uid->bytes[offset], 3);
+	} else {
+		memcpy(uid_cl, &uid->bytes[offset], 4);
+	}
+
+	uid_cl[4] = uid_cl[0] ^ uid_cl[1] ^ uid_cl[2] ^ uid_cl[3];
+}
+
+/* Ends detection with status, the card is still halted */
+void MFRC522_DetectFail(MFRC522_Handle_t *reader, MFRC522_Detect_t *ctx, MFRC522_Status_t status) {
+	MFRC522_WriteRegister(reader, MFRC522_BIT_FRAMING_REG, 0x00);
+	ctx->status = status;
+	ctx->state = MFRC522_DETECT_HALT;
+}
+
+/*
+ * Runs the digital self test (section 16.1.1) and stores the 64 bytes it
+ * leaves in the FIFO in result. The reader is reset, so initialize it again.
+ */
+MFRC522_Status_t MFRC522_SelfTest(MFRC522_Handle_t *reader, uint8_t *result) {
+	uint8_t zeros[25] = { 0 };
+	uint8_t n;
+
+	MFRC522_Reset(reader);
+
+	// Clear the internal buffer
+	MFRC522_WriteRegister(reader, MFRC522_FIFO_LEVEL_REG, MFRC522_FIFO_FLUSH);
+	MFRC522_WriteFIFO(reader, zeros, sizeof(zeros));
+	MFRC522_WriteRegister(reader, MFRC522_COMMAND_REG, MFRC522_COMMAND_MEM);
+
+	MFRC522_WriteRegister(reader, MFRC522_AUTO_TEST_REG, 0x09); // SelfTest = 1001b
+	MFRC522_WriteFIFO(reader, zeros, 1);
+	MFRC522_WriteRegister(reader, MFRC522_COMMAND_REG, MFRC522_COMMAND_CALC_CRC);
+
+	uint32_t start = HAL_GetTick();
+	do {
+		n = MFRC522_ReadRegister(reader, MFRC522_FIFO_LEVEL_REG);
+	} while (n < MFRC522_FIFO_SIZE && (HAL_GetTick() - start) <= MFRC522_IRQ_MARGIN);
+
+	MFRC522_WriteRegister(reader, MFRC522_COMMAND_REG, MFRC522_COMMAND_IDLE);
+	MFRC522_WriteRegister(reader, MFRC522_AUTO_TEST_REG, 0x00);
+	MFRC522_WriteRegister(reader, MFRC522_DIVL_RQ_REG, MFRC522_DIVIRQ_CRC); // The self test ran CalcCRC too
+
+	if (n < MFRC522_FIFO_SIZE) {
+		return RFID_TIMEOUT;
+	}
+
+	MFRC522_ReadFIFO(reader, result, MFRC522_FIFO_SIZE);
+
+	return RFID_OK;
+}
+
+/* Checks the current SPI clock against the VERSION and self test results of a good one */
+MFRC522_Status_t MFRC522_CheckSPI(MFRC522_Handle_t *reader, uint8_t version, uint8_t *signature) {
+	uint8_t pattern[MFRC522_FIFO_SIZE];
+	uint8_t readback[MFRC522_FIFO_SIZE];
+
+	// Every byte flips all bits of the one before it
+	for (uint8_t i = 0; i < MFRC522_FIFO_SIZE; i++) {
+		pattern[i] = ((i & 1) ? 0xAA : 0x55) ^ (i >> 1);
+	}
+
+	for (uint8_t round = 0; round < MFRC522_CALIBRATION_ROUNDS; round++) {
+		if (MFRC522_ReadRegister(reader, MFRC522_VERSION_REG) != version) {
+			return RFID_ERR;
+		}
+
+		MFRC522_WriteRegister(reader, MFRC522_FIFO_LEVEL_REG, MFRC522_FIFO_FLUSH);
+		MFRC522_WriteFIFO(reader, pattern, MFRC522_FIFO_SIZE);
+
+		if (MFRC522_ReadRegister(reader, MFRC522_FIFO_LEVEL_REG) != MFRC522_FIFO_SIZE) {
+			return RFID_ERR;
+		}
+
+		MFRC522_ReadFIFO(reader, readback, MFRC522_FIFO_SIZE);
+		if (memcmp(pattern, readback, MFRC522_FIFO_SIZE) != 0) {
+			return RFID_ERR;
+		}
+	}
+
+	if (MFRC522_SelfTest(reader, readback) != RFID_OK
+	        || memcmp(signature, readback, MFRC522_FIFO_SIZE) != 0) {
+		return RFID_ERR;
+	}
+
+	return RFID_OK;
+}
 
-/* Private function definitions */
-void MFRC522_Reset(void);
-void MFRC522_ChipSelect(void);
-void MFRC522_ChipDeselect(void);
-void MFRC522_WriteRegister(uint8_t reg, uint8_t data);
-uint8_t MFRC522_ReadRegister(uint8_t reg);
-void MFRC522_EnableAntenna(void);
-void MFRC522_DisableAntenna(void);
-void MFRC522_SetBitMask(uint8_t reg, uint8_t mask);
-void MFRC522_ClearBitMask(uint8_t reg, uint8_t mask);
-void MFRC522_Halt(void);
-MFRC522_Status_t MFRC522_Request(uint8_t request_mode, uint8_t *tag_type);
-MFRC522_Status_t MFRC522_ToCard(uint8_t command, uint8_t *in_data, uint8_t in_len,
-        uint8_t *out_data, uint16_t *out_len);
-MFRC522_Status_t MFRC522_Anticollision(uint8_t *serial_num);
-MFRC522_Status_t MFRC522_CalculateCRC(uint8_t *in_data, uint8_t len,
-        uint8_t *out_data);
-MFRC522_Status_t MFRC522_SelectTag(uint8_t *serial_num, uint8_t *type);
+/* Changes the SPI clock prescaler of the bus (one of SPI_BAUDRATEPRESCALER_x) */
+void MFRC522_SetPrescaler(MFRC522_Bus_t *bus, uint32_t prescaler) {
+	bus->spi->Init.BaudRatePrescaler = prescaler;
 
-/* Initializes the reader */
-void MFRC522_Init() {
-	MFRC522_ChipDeselect();
-	MFRC522_Reset();
+	// The peripheral is already set up, so this only rewrites its configuration
+	if (HAL_SPI_Init(bus->spi) != HAL_OK) {
+		printf("[ERROR]: (SetPrescaler) Failed to reconfigure SPI\r\n");
+	}
+}
 
-	MFRC522_WriteRegister(MFRC522_T_MODE_REG, 0x8D);
-	MFRC522_WriteRegister(MFRC522_T_PRESCALER_REG, 0x3E);
-	MFRC522_WriteRegister(MFRC522_T_RELOAD_REG_H, 0x03);
-	MFRC522_WriteRegister(MFRC522_T_RELOAD_REG_L, 0xE8);
-	MFRC522_WriteRegister(MFRC522_RFC_FG_REG, 0x70);
-	MFRC522_WriteRegister(MFRC522_TX_ASK_REG, 0x40);
-	MFRC522_WriteRegister(MFRC522_MODE_REG, 0x3D);
+/* Returns the SPI clock in Hz that a prescaler gives on the bus */
+uint32_t MFRC522_BusClock(MFRC522_Bus_t *bus, uint32_t prescaler) {
+	uint32_t pclk;
+
+	// SPI2 and SPI3 are on APB1, the others on APB2
+	if (bus->spi->Instance == SPI2 || bus->spi->Instance == SPI3) {
+		pclk = HAL_RCC_GetPCLK1Freq();
+	} else {
+		pclk = HAL_RCC_GetPCLK2Freq();
+	}
 
-	MFRC522_EnableAntenna();
+	return pclk / (2 << (prescaler / SPI_CR1_BR_0));
 }
 
-/* Returns the reader's version number */
-uint8_t MFRC522_Version() {
-	return MFRC522_ReadRegister(MFRC522_VERSION_REG);
+/* Sets up the CRC backend and checks it against the reader's coprocessor */
+void MFRC522_InitCRC(MFRC522_Handle_t *reader) {
+	// SELECT and HALT frames, the two frames the driver computes a CRC for
+	uint8_t vectors[2][7] = { { MFRC522_PICC_SELECT_TAG, 0x70, 0x4D, 0xAF, 0x84, 0x59, 0x3F },
+	        { MFRC522_PICC_HALT, 0x00 } };
+	uint8_t lengths[2] = { 7, 2 };
+	uint8_t expected[2];
+	uint8_t actual[2];
+
+#if MFRC522_CRC_BACKEND == MFRC522_CRC_HARDWARE
+	__HAL_RCC_CRC_CLK_ENABLE();
+
+	// CRC_A is the reflected form of CRC-16/CCITT, with init 0x6363 (0xC6C6 reflected)
+	CRC_InitStruct.Instance = CRC;
+	CRC_InitStruct.Init.DefaultPolynomialUse = DEFAULT_POLYNOMIAL_DISABLE;
+	CRC_InitStruct.Init.DefaultInitValueUse = DEFAULT_INIT_VALUE_DISABLE;
+	CRC_InitStruct.Init.GeneratingPolynomial = 0x1021;
+	CRC_InitStruct.Init.CRCLength = CRC_POLYLENGTH_16B;
+	CRC_InitStruct.Init.InitValue = 0xC6C6;
+	CRC_InitStruct.Init.InputDataInversionMode = CRC_INPUTDATA_INVERSION_BYTE;
+	CRC_InitStruct.Init.OutputDataInversionMode = CRC_OUTPUTDATA_INVERSION_ENABLE;
+	CRC_InitStruct.InputDataFormat = CRC_INPUTDATA_FORMAT_BYTES;
+
+	if (HAL_CRC_Init(&CRC_InitStruct) != HAL_OK) {
+		printf("[ERROR]: (InitCRC) Failed to initialize the CRC peripheral\r\n");
+		MFRC522_CRCFallback = 1;
+		return;
+	}
+#endif
+
+	for (uint8_t i = 0; i < 2; i++) {
+		if (MFRC522_CalculateCRCReader(reader, vectors[i], lengths[i], expected) != RFID_OK) {
+			printf("[ERROR]: (InitCRC) Coprocessor did not respond, skipping self test\r\n");
+			return;
+		}
+
+		MFRC522_CalculateCRC(reader, vectors[i], lengths[i], actual);
+		if (actual[0] != expected[0] || actual[1] != expected[1]) {
+			printf("[ERROR]: (InitCRC) CRC mismatch, falling back to the coprocessor\r\n");
+			MFRC522_CRCFallback = 1;
+			return;
+		}
+	}
 }
 
-/* If card is found, its id and type are returned */
-MFRC522_Status_t MFRC522_CheckCard(uint8_t *id, uint8_t *type) {
-	MFRC522_Status_t status = MFRC522_Request(MFRC522_PICC_REQ_IDL, id);
-	if (status == RFID_OK) { // Detected card
-		status = MFRC522_Anticollision(id);
-		status = MFRC522_SelectTag(id, type);
+/* Calculates CRC_A of in_data and stores it LSB first in out_data */
+MFRC522_Status_t MFRC522_CalculateCRC(MFRC522_Handle_t *reader, uint8_t *in_data, uint16_t len,
+        uint8_t *out_data) {
+	if (MFRC522_CRC_BACKEND == MFRC522_CRC_COPROCESSOR || MFRC522_CRCFallback) {
+		return MFRC522_CalculateCRCReader(reader, in_data, len, out_data);
 	}
 
-	MFRC522_Halt();
-	return status;
+#if MFRC522_CRC_BACKEND == MFRC522_CRC_HARDWARE
+	uint16_t crc = HAL_CRC_Calculate(&CRC_InitStruct, (uint32_t*) in_data, len);
+#else
+	uint16_t crc = 0x6363;
+	for (uint16_t i = 0; i < len; i++) {
+		crc = (crc >> 8) ^ MFRC522_CRC_A_Table[(crc ^ in_data[i]) & 0xFF];
+	}
+#endif
+
+	out_data[0] = crc & 0xFF;
+	out_data[1] = crc >> 8;
+
+	return RFID_OK;
 }
 
-/* Check if two RFID card IDs match */
-MFRC522_Status_t MFRC522_CompareIDs(uint8_t *id1, uint8_t *id2) {
-	for (uint8_t i = 0; i < 5; i++) {
-		if (id1[i] != id2[i]) {
-			return RFID_ERR;
-		}
+/* Calculates CRC_A on the reader's CRC coprocessor */
+MFRC522_Status_t MFRC522_CalculateCRCReader(MFRC522_Handle_t *reader, uint8_t *in_data, uint16_t len,
+        uint8_t *out_data) {
+	// CalcCRC only sees what is in the FIFO
+	if (len > MFRC522_FIFO_SIZE) {
+		return MFRC522_Error(reader, RFID_OVERFLOW);
+	}
+
+	MFRC522_WriteRegister(reader, MFRC522_DIVL_RQ_REG, MFRC522_DIVIRQ_CRC); // Set2 = 0 clears the marked bits
+	MFRC522_WriteRegister(reader, MFRC522_COML_RQ_REG, MFRC522_IRQ_ALL); // Release the IRQ pin
+	MFRC522_WriteRegister(reader, MFRC522_FIFO_LEVEL_REG, MFRC522_FIFO_FLUSH); // Clear FIFO pointer
+	MFRC522_WriteRegister(reader, MFRC522_COMMAND_REG, MFRC522_COMMAND_IDLE); // Stop active commands
+	MFRC522_WriteRegister(reader, MFRC522_DIVL_EN_REG, MFRC522_DIVIEN_PUSH_PULL | MFRC522_DIVIRQ_CRC);
+	MFRC522_ArmIRQ(reader);
+
+	// Write data to FIFO
+	MFRC522_WriteFIFO(reader, in_data, len);
+
+	MFRC522_WriteRegister(reader, MFRC522_COMMAND_REG, MFRC522_COMMAND_CALC_CRC);
+
+	// Wait for calculation to complete
+	uint8_t n = MFRC522_WaitForIRQ(reader, MFRC522_DIVL_RQ_REG, MFRC522_DIVIRQ_CRC, MFRC522_IRQ_MARGIN);
+
+	// Release the IRQ pin either way, or the next command never sees a falling edge
+	MFRC522_WriteRegister(reader, MFRC522_DIVL_RQ_REG, MFRC522_DIVIRQ_CRC);
+	MFRC522_WriteRegister(reader, MFRC522_DIVL_EN_REG, MFRC522_DIVIEN_PUSH_PULL);
+
+	// Timeout
+	if (!(n & MFRC522_DIVIRQ_CRC)) {
+		return RFID_TIMEOUT;
 	}
 
+	// Save result
+	out_data[0] = MFRC522_ReadRegister(reader, MFRC522_CRC_RESULT_REG_L);
+	out_data[1] = MFRC522_ReadRegister(reader, MFRC522_CRC_RESULT_REG_H);
+
 	return RFID_OK;
 }
 
-/* Write a byte to a register */
-void MFRC522_WriteRegister(uint8_t reg, uint8_t data) {
-	MFRC522_ChipSelect();
+/*
+ * Authenticates the selected card for the sector that holds block with
+ * Crypto1, using key_type (MFRC522_PICC_AUTHENT_1A or 1B) and a 6 byte key.
+ */
+MFRC522_Status_t MFRC522_Authenticate(MFRC522_Handle_t *reader, uint8_t key_type, uint8_t block,
+        const uint8_t *key, MFRC522_UID_t *uid) {
+	uint8_t buffer[12];
+	uint16_t len;
+
+	if (uid->size < 4 || uid->size > MFRC522_UID_MAX_LEN) {
+		return RFID_ERR;
+	}
+
+	buffer[0] = key_type;
+	buffer[1] = block;
+	memcpy(&buffer[2], key, 6);
+
+	// Double and triple size UIDs use their last 4 bytes (AN10927 section 3.2.5)
+	memcpy(&buffer[8], &uid->bytes[uid->size - 4], 4);
 
-	reg = (reg << 1) & 0x7E;
+	MFRC522_SetTimeout(reader, MFRC522_TIMEOUT_MIFARE);
+	MFRC522_Status_t status = MFRC522_ToCard(reader, MFRC522_COMMAND_MF_AUTHENT, buffer,
+	        sizeof(buffer), NULL, &len);
 
-	if (HAL_SPI_Transmit(&SPI_InitStruct, &reg, 1,
-	HAL_MAX_DELAY) != HAL_SPI_ERROR_NONE) {
-		printf("[ERROR]: (WriteRegister) Failed to write address to register\r\n");
+	// MFCrypto1On is only set by a successful authentication
+	if (status != RFID_OK || !(MFRC522_ReadRegister(reader, MFRC522_STATUS2_REG) & MFRC522_STATUS2_CRYPTO1_ON)) {
+		reader->auth_key = 0;
+		return (status != RFID_OK) ? status : RFID_ERR;
 	}
 
-	if (HAL_SPI_Transmit(&SPI_InitStruct, &data, 1,
-	HAL_MAX_DELAY) != HAL_SPI_ERROR_NONE) {
-		printf("[ERROR]: (WriteRegister) Failed to write data to register\r\n");
+	reader->auth_key = key_type;
+	reader->auth_sector = MFRC522_BlockSector(block);
+	memcpy(reader->auth_key_bytes, key, 6);
+	reader->auth_uid = *uid;
+
+	return RFID_OK;
+}
+
+/*
+ * Authenticates for sector unless Crypto1 is already on for it, on the same
+ * card with the same key.
+ */
+MFRC522_Status_t MFRC522_AuthenticateSector(MFRC522_Handle_t *reader, uint8_t sector,
+        uint8_t key_type, const uint8_t *key, MFRC522_UID_t *uid) {
+	if (reader->auth_key == key_type && reader->auth_sector == sector
+	        && memcmp(reader->auth_key_bytes, key, 6) == 0 && reader->auth_uid.size == uid->size
+	        && memcmp(reader->auth_uid.bytes, uid->bytes, uid->size) == 0) {
+		return RFID_OK;
 	}
 
-	MFRC522_ChipDeselect();
+	return MFRC522_Authenticate(reader, key_type, MFRC522_SectorFirstBlock(sector), key, uid);
 }
 
-/* Read a byte from a register */
-uint8_t MFRC522_ReadRegister(uint8_t reg) {
-	uint8_t data = 0x00;
-	uint8_t dummy = 0x00;
+/* Leaves the authenticated state, needed before talking to another card */
+void MFRC522_StopCrypto(MFRC522_Handle_t *reader) {
+	MFRC522_ClearBitMask(reader, MFRC522_STATUS2_REG, MFRC522_STATUS2_CRYPTO1_ON);
+	reader->auth_key = 0;
+}
 
-	MFRC522_ChipSelect();
+/* Reads the 16 bytes of an (authenticated) block */
+MFRC522_Status_t MFRC522_ReadBlock(MFRC522_Handle_t *reader, uint8_t block, uint8_t *data) {
+	uint8_t buffer[MFRC522_MAX_LEN];
+	uint8_t crc[2];
+	uint16_t len;
+
+	buffer[0] = MFRC522_PICC_READ;
+	buffer[1] = block;
+	MFRC522_CalculateCRC(reader, buffer, 2, &buffer[2]);
 
-	reg = (reg << 1) | 0x80;
+	MFRC522_SetTimeout(reader, MFRC522_TIMEOUT_MIFARE);
+	MFRC522_Status_t status = MFRC522_ToCard(reader, MFRC522_COMMAND_TRANSCEIVE, buffer, 4, buffer,
+	        &len);
+
+	// 16 data bytes and CRC_A, anything shorter is a NAK
+	if (status == RFID_OK && len != 18 * 8) {
+		status = RFID_ERR;
+	}
 
-	if (HAL_SPI_Transmit(&SPI_InitStruct, &reg, 1,
-	HAL_MAX_DELAY) != HAL_SPI_ERROR_NONE) {
-		printf("[ERROR]: (ReadRegister) Failed to write address to register\r\n");
+	if (status == RFID_OK) {
+		MFRC522_CalculateCRC(reader, buffer, 16, crc);
+		if (crc[0] != buffer[16] || crc[1] != buffer[17]) {
+			status = MFRC522_Error(reader, RFID_CRC_ERR);
+		}
 	}
 
-	if (HAL_SPI_TransmitReceive(&SPI_InitStruct, &dummy, &data, 1,
-	HAL_MAX_DELAY) != HAL_SPI_ERROR_NONE) {
-		printf("[ERROR]: (ReadRegister) Failed to read data from register\r\n");
+	if (status != RFID_OK) {
+		MFRC522_StopCrypto(reader); // The card dropped the authentication
+		return status;
 	}
 
-	MFRC522_ChipDeselect();
-	return data;
+	memcpy(data, buffer, 16);
+	return RFID_OK;
 }
 
-/* Soft reset the reader */
-void MFRC522_Reset(void) {
-	MFRC522_WriteRegister(MFRC522_COMMAND_REG, MFRC522_COMMAND_SOFT_RESET);
-	HAL_Delay(50);
+/* Writes 16 bytes to an (authenticated) block */
+MFRC522_Status_t MFRC522_WriteBlock(MFRC522_Handle_t *reader, uint8_t block, const uint8_t *data) {
+	uint8_t buffer[MFRC522_MAX_LEN];
+
+	buffer[0] = MFRC522_PICC_WRITE;
+	buffer[1] = block;
+
+	MFRC522_Status_t status = MFRC522_MifareTransceive(reader, buffer, 2, 0);
+	if (status != RFID_OK) {
+		return status;
+	}
+
+	memcpy(buffer, data, 16);
+	return MFRC522_MifareTransceive(reader, buffer, 16, 0);
 }
 
-/* Enables writing to reader */
-void MFRC522_ChipSelect(void) {
-	HAL_GPIO_WritePin(MFRC522_PORT_CS, MFRC522_PIN_CS, 0);
+/*
+ * Reads all blocks of a sector into data (16 bytes per block, 4 blocks, or
+ * 16 in sectors 32 and up of a 4K card), authenticating only if needed.
+ */
+MFRC522_Status_t MFRC522_ReadSector(MFRC522_Handle_t *reader, uint8_t sector, uint8_t key_type,
+        const uint8_t *key, MFRC522_UID_t *uid, uint8_t *data) {
+	MFRC522_Status_t status = MFRC522_AuthenticateSector(reader, sector, key_type, key, uid);
+	uint8_t first = MFRC522_SectorFirstBlock(sector);
+
+	for (uint8_t i = 0; i < MFRC522_SectorBlocks(sector) && status == RFID_OK; i++) {
+		status = MFRC522_ReadBlock(reader, first + i, &data[i * 16]);
+	}
+
+	return status;
 }
 
-/* Enables reading from reader */
-void MFRC522_ChipDeselect(void) {
-	HAL_GPIO_WritePin(MFRC522_PORT_CS, MFRC522_PIN_CS, 1);
+/* Writes the data blocks of a sector, the sector trailer (last block) is left alone */
+MFRC522_Status_t MFRC522_WriteSector(MFRC522_Handle_t *reader, uint8_t sector, uint8_t key_type,
+        const uint8_t *key, MFRC522_UID_t *uid, const uint8_t *data) {
+	MFRC522_Status_t status = MFRC522_AuthenticateSector(reader, sector, key_type, key, uid);
+	uint8_t first = MFRC522_SectorFirstBlock(sector);
+
+	for (uint8_t i = 0; i < MFRC522_SectorBlocks(sector) - 1 && status == RFID_OK; i++) {
+		if (sector == 0 && i == 0) {
+			continue; // Manufacturer block
+		}
+
+		status = MFRC522_WriteBlock(reader, first + i, &data[i * 16]);
+	}
+
+	return status;
 }
 
-void MFRC522_SetBitMask(uint8_t reg, uint8_t mask) {
-	MFRC522_WriteRegister(reg, MFRC522_ReadRegister(reg) | mask);
+/* Reads a value block, RFID_ERR if the block is not in value block format */
+MFRC522_Status_t MFRC522_ReadValue(MFRC522_Handle_t *reader, uint8_t block, int32_t *value) {
+	uint8_t data[16];
+
+	MFRC522_Status_t status = MFRC522_ReadBlock(reader, block, data);
+	if (status != RFID_OK) {
+		return status;
+	}
+
+	// Value, inverted value, value, then address, inverted, address, inverted
+	for (uint8_t i = 0; i < 4; i++) {
+		if (data[i] != data[i + 8] || data[i] != (uint8_t) ~data[i + 4]) {
+			return RFID_ERR;
+		}
+	}
+
+	if (data[12] != data[14] || data[12] != (uint8_t) ~data[13] || data[13] != data[15]) {
+		return RFID_ERR;
+	}
+
+	*value = (int32_t) ((uint32_t) data[0] | ((uint32_t) data[1] << 8) | ((uint32_t) data[2] << 16)
+	        | ((uint32_t) data[3] << 24));
+
+	return RFID_OK;
 }
 
-void MFRC522_ClearBitMask(uint8_t reg, uint8_t mask) {
-	MFRC522_WriteRegister(reg, MFRC522_ReadRegister(reg) & (~mask));
+/* Formats block as a value block holding value */
+MFRC522_Status_t MFRC522_WriteValue(MFRC522_Handle_t *reader, uint8_t block, int32_t value) {
+	uint8_t data[16];
+
+	for (uint8_t i = 0; i < 4; i++) {
+		data[i] = data[i + 8] = (uint32_t) value >> (i * 8);
+		data[i + 4] = ~data[i];
+	}
+
+	data[12] = data[14] = block;
+	data[13] = data[15] = ~block;
+
+	return MFRC522_WriteBlock(reader, block, data);
 }
 
-void MFRC522_EnableAntenna(void) {
-	uint8_t status = MFRC522_ReadRegister(MFRC522_TX_CONTROL_REG);
-	if (!(status & 0x03)) {
-		MFRC522_SetBitMask(MFRC522_TX_CONTROL_REG, 0x03);
+/*
+ * Runs MFRC522_PICC_INCREMENT, DECREMENT or RESTORE on a value block. The
+ * result is held on the card until MFRC522_TransferValue stores it.
+ */
+MFRC522_Status_t MFRC522_ValueOperation(MFRC522_Handle_t *reader, uint8_t command, uint8_t block,
+        int32_t operand) {
+	uint8_t buffer[MFRC522_MAX_LEN];
+
+	buffer[0] = command;
+	buffer[1] = block;
+
+	MFRC522_Status_t status = MFRC522_MifareTransceive(reader, buffer, 2, 0);
+	if (status != RFID_OK) {
+		return status;
+	}
+
+	for (uint8_t i = 0; i < 4; i++) {
+		buffer[i] = (uint32_t) operand >> (i * 8);
 	}
+
+	// The card only answers the operand with a NAK
+	return MFRC522_MifareTransceive(reader, buffer, 4, 1);
 }
 
-void MFRC522_DisableAntenna(void) {
-	MFRC522_ClearBitMask(MFRC522_TX_CONTROL_REG, 0x03);
+/* Stores the result of the last value operation in block */
+MFRC522_Status_t MFRC522_TransferValue(MFRC522_Handle_t *reader, uint8_t block) {
+	uint8_t buffer[MFRC522_MAX_LEN];
+
+	buffer[0] = MFRC522_PICC_TRANSFER;
+	buffer[1] = block;
+
+	return MFRC522_MifareTransceive(reader, buffer, 2, 0);
 }
 
-MFRC522_Status_t MFRC522_Request(uint8_t request_mode, uint8_t *tag_type) {
-	uint16_t data;
+/*
+ * Sends len bytes of data plus CRC_A (data needs 2 spare bytes) and checks
+ * for the 4 bit ACK. With silence_ok a timeout counts as success too.
+ */
+MFRC522_Status_t MFRC522_MifareTransceive(MFRC522_Handle_t *reader, uint8_t *data, uint8_t len,
+        uint8_t silence_ok) {
+	uint8_t response[MFRC522_MAX_LEN];
+	uint16_t bits;
 
-	MFRC522_WriteRegister(MFRC522_BIT_FRAMING_REG, 0x07);
+	MFRC522_CalculateCRC(reader, data, len, &data[len]);
 
-	tag_type[0] = request_mode;
-	MFRC522_Status_t status = MFRC522_ToCard(MFRC522_COMMAND_TRANSCEIVE, tag_type, 1,
-	        tag_type, &data);
-	if (status == RFID_OK && data != 0x10) {
-		printf("[ERROR]: (Request) Received invalid data from ToCard()\r\n");
-		status = RFID_ERR;
+	MFRC522_SetTimeout(reader, MFRC522_TIMEOUT_MIFARE);
+	MFRC522_Status_t status = MFRC522_ToCard(reader, MFRC522_COMMAND_TRANSCEIVE, data, len + 2,
+	        response, &bits);
+
+	if (status == RFID_TIMEOUT && silence_ok) {
+		return RFID_OK;
+	}
+
+	if (status == RFID_OK && (bits != 4 || (response[0] & 0x0F) != 0x0A)) {
+		status = RFID_ERR; // NAK
+	}
+
+	if (status != RFID_OK) {
+		MFRC522_StopCrypto(reader); // The card dropped the authentication
 	}
 
 	return status;
 }
 
-MFRC522_Status_t MFRC522_ToCard(uint8_t command, uint8_t *in_data, uint8_t in_len,
-        uint8_t *out_data, uint16_t *out_len) {
-	MFRC522_Status_t status = RFID_ERR;
-	uint8_t irq_en = 0x00;
-	uint8_t wait_irq = 0x00;
-	uint8_t last_bits;
+/*
+ * Activates ISO14443-4 on the selected card uid (RATS, then PPS if the card
+ * allows a higher bit rate) and fills in tcl. The rate is capped by
+ * MFRC522_TCL_MAX_SPEED and by earlier failures at higher rates with this
+ * card. The card must have answered the select with SAK bit 6 (0x20) set.
+ */
+MFRC522_Status_t MFRC522_ActivateTCL(MFRC522_Handle_t *reader, MFRC522_UID_t *uid,
+        MFRC522_TCL_t *tcl) {
+	uint8_t *frame = tcl->tx;
+	uint8_t fsci = 2, ta = 0;
+	uint16_t len;
 
-	switch (command) {
-	case MFRC522_COMMAND_MF_AUTHENT:
-		irq_en = 0x12;
-		wait_irq = 0x10;
-		break;
-	case MFRC522_COMMAND_TRANSCEIVE:
-		irq_en = 0x77;
-		wait_irq = 0x30;
-		break;
-	default:
-		break;
-	}
+	memset(tcl, 0, sizeof(*tcl));
+	tcl->uid = *uid;
+	tcl->fwi = 4;
 
-	MFRC522_WriteRegister(MFRC522_COML_EN_REG, (irq_en | 0x80));
-	MFRC522_WriteRegister(MFRC522_COMMAND_REG, MFRC522_COMMAND_IDLE); // Stop active commands
-	MFRC522_ClearBitMask(MFRC522_COLL_REG, 0x80); // Clear collision register
-	MFRC522_WriteRegister(MFRC522_COML_RQ_REG, 0x7F); // Clear interrupt request bits
-	MFRC522_SetBitMask(MFRC522_FIFO_LEVEL_REG, 0x80); // Initialize FIFO
+	frame[0] = MFRC522_PICC_RATS;
+	frame[1] = MFRC522_TCL_FSDI << 4; // CID 0
 
-	// Write data to FIFO
-	for (uint16_t i = 0; i < in_len; i++) {
-		MFRC522_WriteRegister(MFRC522_FIFO_DATA_REG, in_data[i]);
+	MFRC522_SetTimeout(reader, MFRC522_TIMEOUT_RATS);
+	MFRC522_Status_t status = MFRC522_TransceiveFrame(reader, frame, 2, tcl->rx, sizeof(tcl->rx), &len);
+	if (status != RFID_OK) {
+		return status;
 	}
 
-	// Execute command
-	MFRC522_WriteRegister(MFRC522_COMMAND_REG, command);
-	if (command == MFRC522_COMMAND_TRANSCEIVE) {
-		MFRC522_SetBitMask(MFRC522_BIT_FRAMING_REG, 0x80);
+	// TL counts the whole ATS without CRC_A
+	if (len < 1 || tcl->rx[0] != len || len > sizeof(tcl->ats)) {
+		return MFRC522_Error(reader, RFID_PROTOCOL_ERR);
 	}
 
-	// Wait to receive data
-	uint8_t n;
-	uint16_t i = 36000;
-	do {
-		n = MFRC522_ReadRegister(MFRC522_COML_RQ_REG);
-		i--;
-	} while ((i != 0) && !(n & 0x01) && !(n & wait_irq));
+	memcpy(tcl->ats, tcl->rx, len);
+	tcl->ats_len = len;
 
-	MFRC522_ClearBitMask(MFRC522_BIT_FRAMING_REG, 0x80);
+	// T0 announces which of TA(1), TB(1) and TC(1) follow (section 5.2)
+	if (len > 1) {
+		uint8_t t0 = tcl->ats[1];
+		uint8_t i = 2;
 
-	// Error
-	uint8_t error_reg_val = MFRC522_ReadRegister(MFRC522_ERROR_REG);
-	if (error_reg_val & 0x13) {
-		printf("[ERROR]: (ToCard) Error register reported error (1)\r\n");
-		return RFID_ERR;
+		fsci = t0 & 0x0F;
+
+		if ((t0 & 0x10) && i < len) {
+			ta = tcl->ats[i++];
+		}
+
+		if ((t0 & 0x20) && i < len) {
+			tcl->fwi = tcl->ats[i] >> 4;
+			tcl->sfgi = tcl->ats[i] & 0x0F;
+		}
 	}
 
-	// Timeout
-	if (i == 0) {
-		return RFID_TIMEOUT;
-	} else if ((n & 0x01) && !(n & wait_irq)) {
-		return RFID_TIMEOUT;
+	tcl->fsc = MFRC522_FrameSizes[(fsci > 8) ? 8 : fsci];
+
+	if (tcl->fwi > 14) {
+		tcl->fwi = 4;
+	}
+
+	if (tcl->sfgi > 14) {
+		tcl->sfgi = 0;
+	}
+
+	// The card may need a guard time before it accepts the next frame
+	if (tcl->sfgi) {
+		MFRC522_Delay((MFRC522_FWT(tcl->sfgi) + 999) / 1000);
 	}
 
-	if (i != 0) {
-		if (!(MFRC522_ReadRegister(MFRC522_ERROR_REG) & 0x1B)) {
-			status = RFID_OK;
+	MFRC522_Rate_t *rate = MFRC522_RateRecord(uid, 1);
+	rate->speed = MFRC522_SPEED_106;
+
+	// Highest rate both sides support, DS is card to reader and DR reader to card
+	uint8_t ds = MFRC522_SPEED_106, dr = MFRC522_SPEED_106;
+	for (uint8_t speed = MFRC522_SPEED_212; speed <= rate->max_speed; speed++) {
+		uint8_t both = (ta & (0x10 << (speed - 1))) && (ta & (0x01 << (speed - 1)));
 
-			if (command == MFRC522_COMMAND_TRANSCEIVE) {
-				n = MFRC522_ReadRegister(MFRC522_FIFO_LEVEL_REG);
-				last_bits = MFRC522_ReadRegister(MFRC522_CONTROL_REG) & 0x07;
+		if ((ta & 0x80) ? both : (ta & (0x10 << (speed - 1))) != 0) {
+			ds = speed;
+		}
 
-				if (!n) {
-					n = 1;
-				}
+		if ((ta & 0x80) ? both : (ta & (0x01 << (speed - 1))) != 0) {
+			dr = speed;
+		}
+	}
 
-				if (last_bits) {
-					*out_len = (n - 1) * 8 + last_bits;
-				} else {
-					*out_len = n * 8;
-				}
+	if (ds != MFRC522_SPEED_106 || dr != MFRC522_SPEED_106) {
+		frame[0] = MFRC522_PICC_PPS; // CID 0
+		frame[1] = 0x11; // PPS1 follows
+		frame[2] = (ds << 2) | dr;
 
-				if (n > MFRC522_MAX_LEN) {
-					n = MFRC522_MAX_LEN;
-				}
+		MFRC522_SetFWI(reader, tcl->fwi);
+		status = MFRC522_TransceiveFrame(reader, frame, 3, tcl->rx, sizeof(tcl->rx), &len);
 
-				// Read the received data from FIFO
-				for (uint16_t i = 0; i < n; i++) {
-					out_data[i] = MFRC522_ReadRegister(MFRC522_FIFO_DATA_REG);
-				}
-			}
+		// Without a PPS response the card stays at 106 kbps
+		if (status == RFID_OK && len == 1 && tcl->rx[0] == MFRC522_PICC_PPS) {
+			MFRC522_SetSpeed(reader, dr, ds);
+			tcl->tx_speed = dr;
+			tcl->rx_speed = ds;
+			rate->speed = (ds > dr) ? ds : dr;
 		} else {
-			printf("[ERROR]: (ToCard) Error register reported error (2)\r\n");
-			return RFID_ERR;
+			MFRC522_RateFallback(uid, (ds > dr) ? ds : dr);
 		}
 	}
 
-	// Collision error
-	if (error_reg_val & 0x08) {
-		printf("[ERROR]: (ToCard) Detected collision\r\n");
-		return RFID_ERR;
+	return RFID_OK;
+}
+
+/*
+ * Sends an APDU and receives the response. If that fails above 106 kbps, the
+ * card's rate is lowered for its next activation, PPS cannot be repeated
+ * within a session, so the caller has to select and activate the card again.
+ */
+MFRC522_Status_t MFRC522_ExchangeAPDU(MFRC522_Handle_t *reader, MFRC522_TCL_t *tcl,
+        const uint8_t *apdu, uint16_t len, uint8_t *resp, uint16_t resp_size, uint16_t *resp_len) {
+	MFRC522_Status_t status = MFRC522_ExchangeChained(reader, tcl, apdu, len, resp, resp_size, resp_len);
+
+	if (status != RFID_OK && (tcl->tx_speed || tcl->rx_speed)) {
+		MFRC522_RateFallback(&tcl->uid, (tcl->tx_speed > tcl->rx_speed) ? tcl->tx_speed : tcl->rx_speed);
 	}
 
 	return status;
 }
 
-MFRC522_Status_t MFRC522_Anticollision(uint8_t *serial_num) {
-	uint16_t len;
-	uint8_t temp = 0;
+/*
+ * Sends an APDU and receives the response, chaining I-blocks in both
+ * directions when they do not fit the card's FSC or our MFRC522_TCL_FSD.
+ */
+MFRC522_Status_t MFRC522_ExchangeChained(MFRC522_Handle_t *reader, MFRC522_TCL_t *tcl,
+        const uint8_t *apdu, uint16_t len, uint8_t *resp, uint16_t resp_size, uint16_t *resp_len) {
+	uint8_t *tx = tcl->tx;
+	uint8_t *rx = tcl->rx;
+	uint16_t rx_len;
+	uint16_t tx_len;
+	uint16_t sent = 0;
+	uint8_t retries = 0;
+	MFRC522_Status_t status;
+
+	// Room for the PCB and CRC_A
+	uint16_t chunk_max = ((tcl->fsc < MFRC522_TCL_FSD) ? tcl->fsc : MFRC522_TCL_FSD) - 3;
+
+	*resp_len = 0;
+	MFRC522_SetFWI(reader, tcl->fwi);
+
+	// Send the APDU, every chained I-block has to be acknowledged with R(ACK)
+	for (;;) {
+		uint16_t chunk = (len - sent > chunk_max) ? chunk_max : len - sent;
+		uint8_t chaining = (sent + chunk < len);
+
+		tx[0] = MFRC522_TCL_I_BLOCK | tcl->block_num | (chaining ? MFRC522_TCL_CHAINING : 0);
+		memcpy(&tx[1], &apdu[sent], chunk);
+
+		tx_len = chunk + 1;
+		status = MFRC522_ExchangeBlock(reader, tcl, tx_len, &rx_len);
+		if (status != RFID_OK) {
+			return status;
+		}
+
+		if ((rx[0] & 0xF6) != MFRC522_TCL_R_ACK) {
+			if (!chaining) {
+				break;
+			}
+			return RFID_ERR;
+		}
 
-	MFRC522_WriteRegister(MFRC522_BIT_FRAMING_REG, 0x00);
+		// The card only acknowledges the current block of a chain, any other ACK,
+		// including one after our R(NAK) for the last block, asks for it again (rule 6)
+		if (!chaining || (rx[0] & 0x01) != tcl->block_num) {
+			if (++retries > MFRC522_TCL_RETRIES) {
+				return RFID_ERR;
+			}
+			continue;
+		}
 
-	serial_num[0] = MFRC522_PICC_ANTICOLLISION;
-	serial_num[1] = 0x20;
+		tcl->block_num ^= 1;
+		sent += chunk;
+		retries = 0;
+	}
 
-	MFRC522_Status_t status = MFRC522_ToCard(MFRC522_COMMAND_TRANSCEIVE, serial_num,
-	        2, serial_num, &len);
-	if (status == RFID_OK) {
-		// Check serial number
-		for (uint8_t i = 0; i < 4; i++) {
-			temp ^= serial_num[i];
-			if (temp != serial_num[i]) {
-				// No need to print anything
+	// Collect the response, acknowledging every chained I-block
+	retries = 0;
+	for (;;) {
+		// An R(ACK) means the card missed our last block, send it again (rule 6)
+		if (rx_len >= 1 && (rx[0] & 0xF6) == MFRC522_TCL_R_ACK) {
+			if (++retries > MFRC522_TCL_RETRIES) {
 				return RFID_ERR;
 			}
+
+			status = MFRC522_ExchangeBlock(reader, tcl, tx_len, &rx_len);
+			if (status != RFID_OK) {
+				return status;
+			}
+			continue;
+		}
+
+		if ((rx[0] & 0xE2) != MFRC522_TCL_I_BLOCK || rx_len < 1) {
+			return RFID_ERR;
+		}
+
+		tcl->block_num ^= 1; // An I-block toggles the block number (rule B)
+
+		// Skip CID and NAD if the card sent them
+		uint8_t offset = 1 + ((rx[0] & 0x08) ? 1 : 0) + ((rx[0] & 0x04) ? 1 : 0);
+		if (rx_len < offset || *resp_len + rx_len - offset > resp_size) {
+			return RFID_ERR;
+		}
+
+		memcpy(&resp[*resp_len], &rx[offset], rx_len - offset);
+		*resp_len += rx_len - offset;
+
+		if (!(rx[0] & MFRC522_TCL_CHAINING)) {
+			return RFID_OK;
+		}
+
+		tx[0] = MFRC522_TCL_R_ACK | tcl->block_num;
+		tx_len = 1;
+		retries = 0;
+		status = MFRC522_ExchangeBlock(reader, tcl, tx_len, &rx_len);
+		if (status != RFID_OK) {
+			return status;
 		}
 	}
+}
 
-	return status;
+/* Deactivates the card with S(DESELECT) and returns to 106 kbps */
+void MFRC522_DeselectTCL(MFRC522_Handle_t *reader, MFRC522_TCL_t *tcl) {
+	uint16_t len;
+
+	tcl->tx[0] = MFRC522_TCL_S_DESELECT;
+
+	MFRC522_SetFWI(reader, tcl->fwi);
+	MFRC522_TransceiveFrame(reader, tcl->tx, 1, tcl->rx, sizeof(tcl->rx), &len);
+	MFRC522_SetSpeed(reader, MFRC522_SPEED_106, MFRC522_SPEED_106);
 }
 
-MFRC522_Status_t MFRC522_CalculateCRC(uint8_t *in_data, uint8_t len,
-        uint8_t *out_data) {
-	MFRC522_ClearBitMask(MFRC522_DIVL_RQ_REG, 0x04); // CRCIrq = 0
-	MFRC522_SetBitMask(MFRC522_FIFO_LEVEL_REG, 0x80); // Clear FIFO pointer
-	MFRC522_WriteRegister(MFRC522_COMMAND_REG, MFRC522_COMMAND_IDLE); // Stop active commands
+/*
+ * Sends the len byte block in tcl->tx and returns the card's I- or R-block
+ * in tcl->rx. Waiting time extensions are granted on the way, and lost or
+ * broken answers are asked for again with R(NAK), or R(ACK) while the card
+ * is chaining (rules 4 and 5).
+ */
+MFRC522_Status_t MFRC522_ExchangeBlock(MFRC522_Handle_t *reader, MFRC522_TCL_t *tcl, uint16_t len,
+        uint16_t *rx_len) {
+	uint8_t *block = tcl->tx;
+	uint8_t *rx = tcl->rx;
+	uint8_t reply[4];
+	uint8_t *frame = block;
+	uint16_t frame_len = len;
+	uint8_t retries = 0;
+
+	for (;;) {
+		MFRC522_Status_t status = MFRC522_TransceiveFrame(reader, frame, frame_len, rx, sizeof(tcl->rx),
+		        rx_len);
+
+		if (status == RFID_OK && *rx_len >= 2 && (rx[0] & 0xF7) == MFRC522_TCL_S_WTX) {
+			uint8_t wtxm = rx[1] & 0x3F;
+
+			// Grant the extension for this one answer
+			reply[0] = MFRC522_TCL_S_WTX;
+			reply[1] = wtxm;
+			frame = reply;
+			frame_len = 2;
+			// FWT * WTXM may not exceed FWTmax (ISO14443-4 section 7.3)
+			uint32_t fwt = MFRC522_FWT(tcl->fwi) * (wtxm ? wtxm : 1);
+			MFRC522_SetTimeout(reader, (fwt < MFRC522_FWT(14)) ? fwt : MFRC522_FWT(14));
+			continue;
+		}
 
-	// Write data to FIFO
-	for (uint8_t i = 0; i < len; i++) {
-		MFRC522_WriteRegister(MFRC522_FIFO_DATA_REG, *(in_data + i));
+		MFRC522_SetFWI(reader, tcl->fwi);
+
+		if (status == RFID_OK && *rx_len >= 1) {
+			return RFID_OK;
+		}
+
+		if (++retries > MFRC522_TCL_RETRIES) {
+			return (status != RFID_OK) ? status : RFID_ERR;
+		}
+
+		reply[0] = ((block[0] & 0xF6) == MFRC522_TCL_R_ACK) ? block[0]
+		        : (MFRC522_TCL_R_NAK | tcl->block_num);
+		frame = reply;
+		frame_len = 1;
 	}
+}
 
-	MFRC522_WriteRegister(MFRC522_COMMAND_REG, MFRC522_COMMAND_CALC_CRC);
+/*
+ * Sends len bytes of frame plus CRC_A (frame needs 2 spare bytes) and checks
+ * the answer's CRC_A. Frames longer than the FIFO are streamed through it.
+ */
+MFRC522_Status_t MFRC522_TransceiveFrame(MFRC522_Handle_t *reader, uint8_t *frame, uint16_t len,
+        uint8_t *rx, uint16_t rx_size, uint16_t *rx_len) {
+	uint8_t crc[2];
+	uint16_t bits;
 
-	// Wait for calculation to complete
-	uint8_t i = 0xFF;
-	uint8_t n;
-	do {
-		n = MFRC522_ReadRegister(MFRC522_DIVL_RQ_REG);
-		i--;
-	} while ((i != 0) && !(n & 0x04));
+	MFRC522_CalculateCRC(reader, frame, len, &frame[len]);
+	MFRC522_StartStream(reader, MFRC522_COMMAND_TRANSCEIVE, frame, len + 2, rx_size > MFRC522_FIFO_SIZE);
 
-	// Timeout
-	if (i == 0) {
-		return RFID_TIMEOUT;
+	MFRC522_Status_t status = MFRC522_FinishCommandBuffer(reader, rx, rx_size, &bits);
+	if (status != RFID_OK) {
+		return status;
 	}
 
-	// Save result
-	out_data[0] = MFRC522_ReadRegister(MFRC522_CRC_RESULT_REG_L);
-	out_data[1] = MFRC522_ReadRegister(MFRC522_CRC_RESULT_REG_H);
+	// Whole bytes only, at least one besides CRC_A
+	if ((bits % 8) || bits < 3 * 8 || bits > rx_size * 8) {
+		return MFRC522_Error(reader, RFID_PROTOCOL_ERR);
+	}
+
+	*rx_len = bits / 8 - 2;
+
+	MFRC522_CalculateCRC(reader, rx, *rx_len, crc);
+	if (crc[0] != rx[*rx_len] || crc[1] != rx[*rx_len + 1]) {
+		return MFRC522_Error(reader, RFID_CRC_ERR);
+	}
 
 	return RFID_OK;
 }
 
-MFRC522_Status_t MFRC522_SelectTag(uint8_t *serial_num, uint8_t *type) {
-	uint8_t buffer[9];
-	uint8_t sak[3] = { 0 };
-	uint16_t out_data;
+/* Sets the bit rate of both directions (MFRC522_SPEED_x) along with the modulation and receiver */
+void MFRC522_SetSpeed(MFRC522_Handle_t *reader, uint8_t tx_speed, uint8_t rx_speed) {
+	// TxSpeed and RxSpeed, CRC stays with the host
+	MFRC522_WriteRegister(reader, MFRC522_TX_MODE_REG, tx_speed << 4);
+	MFRC522_WriteRegister(reader, MFRC522_RX_MODE_REG, rx_speed << 4);
 
-	buffer[0] = MFRC522_PICC_SELECT_TAG;
-	buffer[1] = 0x70;
+	// Modified Miller pauses shrink with the bit duration, the card answers with BPSK above 106 kbps
+	MFRC522_WriteRegister(reader, MFRC522_MOD_WIDTH_REG, MFRC522_ModWidths[tx_speed]);
+	MFRC522_WriteRegister(reader, MFRC522_RX_THRESHOLD_REG, (rx_speed == MFRC522_SPEED_106)
+	        ? reader->tuning.rx_threshold : MFRC522_RxThresholds[rx_speed]);
+}
 
-	for (uint8_t i = 0; i < 4; i++) {
-		buffer[i + 2] = *(serial_num + i);
-	}
+/* Returns the bit rate last negotiated with a card (MFRC522_SPEED_x), 106 kbps if it is not known */
+uint8_t MFRC522_CardSpeed(MFRC522_UID_t *uid) {
+	MFRC522_Rate_t *rate = MFRC522_RateRecord(uid, 0);
 
-	// Calculate CRC
-	buffer[6] = buffer[2] ^ buffer[3] ^ buffer[4] ^ buffer[5];
-	MFRC522_Status_t status = MFRC522_CalculateCRC(buffer, 7, &buffer[7]);
-	if (status != RFID_OK) {
-		printf("[ERROR]: (SelectTag) CalculateCRC returned error (1)\r\n");
-		return status;
+	return (rate != NULL) ? rate->speed : MFRC522_SPEED_106;
+}
+
+/* Finds the rate record of a card, with create a new card takes over the oldest record */
+MFRC522_Rate_t* MFRC522_RateRecord(MFRC522_UID_t *uid, uint8_t create) {
+	for (uint8_t i = 0; i < MFRC522_RATE_RECORDS; i++) {
+		if (MFRC522_CompareIDs(&MFRC522_Rates[i].uid, uid) == RFID_OK) {
+			return &MFRC522_Rates[i];
+		}
 	}
 
-	status = MFRC522_ToCard(MFRC522_COMMAND_TRANSCEIVE, buffer, 9, sak, &out_data);
-	if (status != RFID_OK) {
-		printf("[ERROR]: (SelectTag) CalculateCRC returned error (2)\r\n");
+	if (!create) {
+		return NULL;
 	}
 
-	// SAK must be 24 bits (1 byte + CRC)
-	if (out_data != 24) {
-		printf("[ERROR]: (SelectTag) SAK mismatch\r\n");
-		return RFID_ERR;
+	MFRC522_Rate_t *rate = &MFRC522_Rates[MFRC522_RateNext];
+	MFRC522_RateNext = (MFRC522_RateNext + 1) % MFRC522_RATE_RECORDS;
+
+	rate->uid = *uid;
+	rate->speed = MFRC522_SPEED_106;
+	rate->max_speed = MFRC522_TCL_MAX_SPEED;
+
+	return rate;
+}
+
+/* Keeps a card below a rate that failed, down to 106 kbps which always stays allowed */
+void MFRC522_RateFallback(MFRC522_UID_t *uid, uint8_t failed_speed) {
+	MFRC522_Rate_t *rate = MFRC522_RateRecord(uid, 1);
+
+	if (failed_speed > MFRC522_SPEED_106 && rate->max_speed >= failed_speed) {
+		rate->max_speed = failed_speed - 1;
 	}
+}
 
-	*type = sak[0];
+/* Returns the first block of a sector, sectors 32 and up of a 4K card have 16 blocks */
+uint8_t MFRC522_SectorFirstBlock(uint8_t sector) {
+	if (sector < 32) {
+		return sector * 4;
+	}
 
-	return status;
+	return 128 + (sector - 32) * 16;
 }
 
-void MFRC522_Halt(void) {
-	uint8_t buff[4];
-	uint16_t len;
+uint8_t MFRC522_SectorBlocks(uint8_t sector) {
+	return (sector < 32) ? 4 : 16;
+}
 
-	buff[0] = MFRC522_PICC_HALT;
-	buff[1] = 0;
+/* Returns the sector a block belongs to */
+uint8_t MFRC522_BlockSector(uint8_t block) {
+	if (block < 128) {
+		return block / 4;
+	}
 
-	MFRC522_CalculateCRC(buff, 2, &buff[2]);
-	MFRC522_ToCard(MFRC522_COMMAND_TRANSCEIVE, buff, 4, buff, &len);
+	return 32 + (block - 128) / 16;
 }
 
 /* Converts binary to string hex (%X) */
@@ -23,6 +23,8 @@
 #include "FreeRTOS.h"
 #include "task.h"
 #include "stm32f769i_discovery_ts.h"
+#include "mfrc522.h"
+#include "sync.h"
 /* Private includes ----------------------------------------------------------*/
 /* USER CODE BEGIN Includes */
 /* USER CODE END Includes */
@@ -60,6 +62,9 @@
 /* External variables --------------------------------------------------------*/
 
 /* USER CODE BEGIN EV */
+extern SPI_HandleTypeDef SPI_InitStruct;
+extern DMA_HandleTypeDef SPI_DMATxStruct;
+extern DMA_HandleTypeDef SPI_DMARxStruct;
 
 /* USER CODE END EV */
 
@@ -184,11 +189,50 @@ void SysTick_Handler(void)
 /******************************************************************************/
 
 /* USER CODE BEGIN 1 */
+void EXTI1_IRQHandler(void)
+{
+
+  HAL_GPIO_EXTI_IRQHandler(MFRC522_PIN_IRQ); // MFRC522 IRQ pin (D2)
+
+}
+
 void EXTI15_10_IRQHandler(void)
 {
 
   HAL_GPIO_EXTI_IRQHandler(TS_INT_PIN); // Reset the GPIO_PIN_13 Interrupt - Touch Screen
 
 }
+
+/**
+  * @brief This function handles the SPI2 RX DMA stream (MFRC522).
+  */
+void DMA1_Stream3_IRQHandler(void)
+{
+  HAL_DMA_IRQHandler(&SPI_DMARxStruct);
+}
+
+/**
+  * @brief This function handles the SPI2 TX DMA stream (MFRC522).
+  */
+void DMA1_Stream4_IRQHandler(void)
+{
+  HAL_DMA_IRQHandler(&SPI_DMATxStruct);
+}
+
+/**
+  * @brief This function handles SPI2 global interrupt (MFRC522).
+  */
+void SPI2_IRQHandler(void)
+{
+  HAL_SPI_IRQHandler(&SPI_InitStruct);
+}
+
+/**
+  * @brief This function handles USART1 global interrupt (access list sync).
+  */
+void USART1_IRQHandler(void)
+{
+  Sync_UARTHandler();
+}
 /* USER CODE END 1 */
 
@@ -0,0 +1,167 @@
+/*
+ * Delta sync of the access list over UART
+ *
+ * The host sends delta batches (see Access_BatchHeader_t) on the same UART
+ * that printf writes to. Every batch is answered with an Access_BatchReply_t
+ * holding the status and the version of the active list. Both start with the
+ * bytes A5 5A, which never occur in the text output. After an interruption
+ * the host asks for the version with an empty batch and resumes from there.
+ *
+ * Text and replies share the UART through Sync_Write and a mutex, and text
+ * is dropped from the start of a batch until its reply is out, so the host
+ * reads nothing but the reply.
+ */
+
+/* Includes */
+#include <string.h>
+
+#include "main.h"
+#include "cmsis_os.h"
+#include "semphr.h"
+#include "stream_buffer.h"
+#include "sync.h"
+
+UART_HandleTypeDef *Sync_UART;
+StreamBufferHandle_t Sync_Stream;
+StaticStreamBuffer_t Sync_StreamBuffer;
+uint8_t Sync_StreamStorage[SYNC_BUFFER_SIZE + 1];
+SemaphoreHandle_t Sync_Mutex;
+StaticSemaphore_t Sync_MutexBuffer;
+volatile uint8_t Sync_Busy; // a batch is being received or answered, text is dropped
+uint8_t Sync_Frame[sizeof(Access_BatchHeader_t) + ACCESS_BATCH_MAX * sizeof(Access_Delta_t) + sizeof(uint32_t)]
+        __attribute__((aligned(4)));
+
+/* Private function definitions */
+uint8_t Sync_Read(uint8_t *data, uint32_t size, TickType_t timeout);
+void Sync_Reply(Access_List_t *list, Access_Status_t status);
+
+/*
+ * Starts receiving on uart, whose interrupt irq has to call Sync_UARTHandler.
+ * Once the scheduler runs, everything else transmitting on uart has to go
+ * through Sync_Write. Call it before the scheduler starts.
+ */
+void Sync_Init(UART_HandleTypeDef *uart, IRQn_Type irq) {
+	Sync_UART = uart;
+	Sync_Stream = xStreamBufferCreateStatic(SYNC_BUFFER_SIZE, 1, Sync_StreamStorage, &Sync_StreamBuffer);
+	Sync_Mutex = xSemaphoreCreateMutexStatic(&Sync_MutexBuffer);
+
+	__HAL_UART_ENABLE_IT(uart, UART_IT_RXNE);
+	HAL_NVIC_SetPriority(irq, 6, 0);
+	HAL_NVIC_EnableIRQ(irq);
+}
+
+/* Receives delta batches and applies them to list, run it in its own task */
+void Sync_Run(Access_List_t *list) {
+	Access_BatchHeader_t *header = (Access_BatchHeader_t*) Sync_Frame;
+	uint32_t buffered = 0; // bytes of the next header already in Sync_Frame
+
+	for (;;) {
+		// Skip anything up to the start of a batch
+		if (buffered == 0) {
+			if (!Sync_Read(Sync_Frame, 1, portMAX_DELAY) || Sync_Frame[0] != (ACCESS_BATCH_MAGIC & 0xFF)) {
+				continue;
+			}
+
+			buffered = 1;
+		}
+
+		if (!Sync_Read(Sync_Frame + buffered, sizeof(*header) - buffered, pdMS_TO_TICKS(SYNC_TIMEOUT_MS))) {
+			buffered = 0;
+			continue;
+		}
+
+		buffered = 0;
+
+		// A false start, the real one may be among the bytes already read
+		if (header->magic != ACCESS_BATCH_MAGIC) {
+			for (uint32_t i = 1; i < sizeof(*header); i++) {
+				if (Sync_Frame[i] == (ACCESS_BATCH_MAGIC & 0xFF)) {
+					buffered = sizeof(*header) - i;
+					memmove(Sync_Frame, Sync_Frame + i, buffered);
+					break;
+				}
+			}
+
+			continue;
+		}
+
+		// No text until the reply is out
+		Sync_Busy = 1;
+
+		if (header->count > ACCESS_BATCH_MAX) {
+			Sync_Reply(list, ACCESS_ERR);
+			continue;
+		}
+
+		uint32_t size = sizeof(*header) + header->count * sizeof(Access_Delta_t) + sizeof(uint32_t);
+
+		// A batch cut short is dropped, the host resends it after its own timeout
+		if (!Sync_Read(Sync_Frame + sizeof(*header), size - sizeof(*header), pdMS_TO_TICKS(SYNC_TIMEOUT_MS))) {
+			Sync_Busy = 0;
+			continue;
+		}
+
+		Sync_Reply(list, Access_ApplyBatch(list, Sync_Frame, size));
+	}
+}
+
+/* Moves received bytes to the sync task, call it from the UART interrupt */
+void Sync_UARTHandler(void) {
+	BaseType_t higher_priority_woken = pdFALSE;
+	USART_TypeDef *uart = Sync_UART->Instance;
+
+	// Reception stops on errors until they are cleared, the batch fails its CRC
+	if (uart->ISR & (USART_ISR_ORE | USART_ISR_FE | USART_ISR_NE)) {
+		uart->ICR = USART_ICR_ORECF | USART_ICR_FECF | USART_ICR_NCF;
+	}
+
+	if (uart->ISR & USART_ISR_RXNE) {
+		uint8_t byte = uart->RDR;
+		xStreamBufferSendFromISR(Sync_Stream, &byte, 1, &higher_priority_woken);
+	}
+
+	portYIELD_FROM_ISR(higher_priority_woken);
+}
+
+/* Reads exactly size bytes, returns 0 if they do not arrive within timeout of each other */
+uint8_t Sync_Read(uint8_t *data, uint32_t size, TickType_t timeout) {
+	uint32_t received = 0;
+
+	while (received < size) {
+		size_t count = xStreamBufferReceive(Sync_Stream, data + received, size - received, timeout);
+
+		if (count == 0) {
+			return 0;
+		}
+
+		received += count;
+	}
+
+	return 1;
+}
+
+/*
+ * Transmits text on the sync UART from any task, printf's _write calls it
+ * once the scheduler runs. Text is dropped while a batch is in progress.
+ */
+void Sync_Write(const uint8_t *data, uint32_t size) {
+	xSemaphoreTake(Sync_Mutex, portMAX_DELAY);
+
+	if (!Sync_Busy) {
+		HAL_UART_Transmit(Sync_UART, (uint8_t*) data, size, HAL_MAX_DELAY);
+	}
+
+	xSemaphoreGive(Sync_Mutex);
+}
+
+/* Answers a batch and lets text through again */
+void Sync_Reply(Access_List_t *list, Access_Status_t status) {
+	Access_BatchReply_t reply = { .magic = ACCESS_BATCH_MAGIC, .status = status, .version =
+	        list->banks[list->active].version };
+
+	// Text that was already going out finishes first
+	xSemaphoreTake(Sync_Mutex, portMAX_DELAY);
+	HAL_UART_Transmit(Sync_UART, (uint8_t*) &reply, sizeof(reply), HAL_MAX_DELAY);
+	Sync_Busy = 0;
+	xSemaphoreGive(Sync_Mutex);
+}